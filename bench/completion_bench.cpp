@@ -0,0 +1,120 @@
+// latency of completing while typing in a session: a few snippets are typed
+// a character at a time and, like an editor completing as you type, every
+// character of a name and every ".", "->" and "::" asks for completions. The
+// header has the declarations of many loaded plugins. Requests go through the
+// worker of the engine, as they do from the editor
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rcrl/rcrl_completion.h"
+
+namespace {
+
+// what the loaded plugins leave in the header chain
+std::string MakeHeader(int declarations) {
+  std::string header =
+      "#pragma once\n#include <algorithm>\n#include <iostream>\n"
+      "#include <map>\n#include <string>\n#include <vector>\n";
+  for (int i = 0; i < declarations; ++i) {
+    const auto n = std::to_string(i);
+    header += "extern int value" + n + ";\nint function" + n +
+              "(int x);\nstruct Type" + n +
+              " { int member; std::vector<int> items; };\n";
+  }
+  return header;
+}
+
+const char* kSnippets[] = {
+    "std::vector<int> numbers = {1, 2, 3};\nnumbers.push_back(value12);\n",
+    "for (auto& n : numbers) {\n  std::cout << function7(n) << std::endl;\n}\n",
+    "Type3 t;\nt.items.push_back(t.member);\nstd::map<std::string, int> "
+    "counts;\ncounts[std::to_string(t.member)] = std::max(t.member, 2);\n"};
+
+bool IsIdentifierCharacter(char c) {
+  return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+bool EndsWith(const std::string& code, const std::string& suffix) {
+  return code.size() >= suffix.size() &&
+         code.compare(code.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// milliseconds until the request is answered
+double Complete(rcrl::CompletionEngine& engine, const std::string& code) {
+  // the cursor is at the end, the code ends with a newline or a name
+  const auto line = std::count(code.begin(), code.end(), '\n') + 1;
+  const auto column = code.size() - code.rfind('\n');
+  const auto start = std::chrono::steady_clock::now();
+  engine.Request(code, line, column);
+  std::vector<rcrl::Completion> completions;
+  while (!engine.TryGetResults(completions)) {
+    std::this_thread::yield();
+  }
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+void Report(const char* name, std::vector<double> ms) {
+  std::sort(ms.begin(), ms.end());
+  auto at = [&](double q) {
+    return ms[std::min(ms.size() - 1, static_cast<size_t>(ms.size() * q))];
+  };
+  std::printf("%-12s %5zu requests  p50 %7.2f ms  p99 %7.2f ms  max %7.2f ms\n",
+              name, ms.size(), at(0.5), at(0.99), ms.back());
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const int declarations = argc > 1 ? std::atoi(argv[1]) : 1000;
+  const auto dir = fs::temp_directory_path() / "rcrl_completion_bench";
+  fs::create_directories(dir);
+  std::ofstream(dir / "plugin.hpp") << MakeHeader(declarations);
+  std::ofstream(dir / "plugin.cpp") << "\n";
+  const std::string include = "#include \"plugin.hpp\"\n";
+  std::vector<double> all;
+  std::vector<double> word_starts;  // where the last results don't apply
+  {
+    rcrl::CompletionEngine engine(dir / "plugin.cpp", {"-std=c++17"});
+    // parses the unit and precompiles the preamble
+    std::printf("%d declarations, first request %.2f ms\n", declarations,
+                Complete(engine, include));
+    // until the user starts typing, the engine warms up
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+
+    for (const std::string snippet : kSnippets) {
+      for (size_t i = 1; i <= snippet.size(); ++i) {
+        const auto code = include + snippet.substr(0, i);
+        // not in numbers
+        auto word = code.size();
+        while (IsIdentifierCharacter(code[word - 1])) {
+          word--;
+        }
+        if (word == code.size() ? !EndsWith(code, ".") &&
+                                      !EndsWith(code, "->") &&
+                                      !EndsWith(code, "::")
+                                : std::isdigit(code[word])) {
+          continue;
+        }
+        const auto elapsed = Complete(engine, code);
+        all.push_back(elapsed);
+        if (IsIdentifierCharacter(snippet[i - 1]) &&
+            (i == 1 || !IsIdentifierCharacter(snippet[i - 2]))) {
+          word_starts.push_back(elapsed);
+        }
+      }
+    }
+  }
+  Report("all", all);
+  Report("word starts", word_starts);
+  fs::remove_all(dir);
+  return 0;
+}
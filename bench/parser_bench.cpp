@@ -0,0 +1,102 @@
+// counts the allocations and time of parsing large snippets and generating
+// the plugin source and header from them: a pasted table and many
+// declarations in namespaces
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <string>
+
+#include "rcrl/rcrl_parser.h"
+
+namespace {
+
+std::atomic<size_t> allocations{0};
+
+// a generated table, the kind of code that is pasted rather than typed
+std::string MakeSnippet(int rows) {
+  std::string code = "#include \"plugin.hpp\"\nint table[][4] = {\n";
+  for (int i = 0; i < rows; ++i) {
+    code += "    {" + std::to_string(i) + ", " + std::to_string(i * 3) + ", " +
+            std::to_string(i * 7) + ", " + std::to_string(i % 11) + "},\n";
+  }
+  code += "};\nint row_sum(int i) {\n  return table[i][0] + table[i][1];\n}\n"
+          "table[0][0] = row_sum(1);\n";
+  return code;
+}
+
+// declarations spread over nested namespaces, with a statement between
+// each group
+std::string MakeDeclarations(int count) {
+  std::string code = "#include \"plugin.hpp\"\n";
+  for (int i = 0; i < count; i += 10) {
+    const auto n = std::to_string(i);
+    code += "namespace group" + n + " {\nnamespace detail {\n";
+    for (int j = i; j < i + 8 && j < count; ++j) {
+      const auto m = std::to_string(j);
+      code += j % 2 ? "int value" + m + " = " + m + ";\n"
+                    : "int function" + m + "(int x) { return x + " + m +
+                          "; }\n";
+    }
+    code += "}\nstruct Type" + n + " { int member; };\n";
+    if (i + 9 < count) {
+      code += "int last = detail::function" + n + "(1);\n";
+    }
+    code += "}\ngroup" + n + "::detail::value" + std::to_string(i + 1) +
+            "++;\n";
+  }
+  return code;
+}
+
+template <class Run>
+void Measure(const char* phase, Run run) {
+  const auto before = allocations.load();
+  const auto start = std::chrono::steady_clock::now();
+  run();
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::printf("%-8s %10zu allocations %10.3f ms\n", phase,
+              allocations.load() - before, elapsed.count());
+}
+
+}  // namespace
+
+void* operator new(size_t size) {
+  allocations++;
+  if (void* p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+int main(int argc, char** argv) {
+  const int rows = argc > 1 ? std::atoi(argv[1]) : 10000;
+  const auto dir = fs::temp_directory_path();
+  const auto file = dir / "rcrl_parser_bench.cpp";
+  const auto header = dir / "plugin.hpp";
+  std::ofstream(header) << "#pragma once\n";
+  rcrl::PluginParser parser(file, {"-std=c++17"});
+
+  const std::pair<std::string, std::string> corpora[] = {
+      {"table of " + std::to_string(rows) + " rows", MakeSnippet(rows)},
+      {"1k declarations", MakeDeclarations(1000)},
+      {"10k declarations", MakeDeclarations(10000)}};
+  for (const auto& [name, code] : corpora) {
+    std::printf("%s\n", name.c_str());
+    // allocations of libclang are counted as well when it links to the same
+    // operator new
+    Measure("reparse", [&]() { parser.Reparse(code); });
+    Measure("source", [&]() { parser.GenerateSourceFile(""); });
+    Measure("header", [&]() {
+      parser.GenerateHeaderFile((dir / "rcrl_parser_bench_gen.hpp").string());
+    });
+    fs::remove(dir / "rcrl_parser_bench_gen.hpp");
+  }
+  fs::remove(file);
+  fs::remove(header);
+  return 0;
+}
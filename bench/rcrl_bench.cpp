@@ -0,0 +1,190 @@
+// latency of submitting snippets end to end, by phase: each case submits its
+// snippets in order to a fresh session and the p50 and p99 of every phase
+// over the submissions are printed and written as json, so that two versions
+// can be compared
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rcrl/config.h"
+#include "rcrl/rcrl.h"
+
+namespace {
+
+struct Case {
+  const char* name;
+  std::vector<std::string> snippets;
+};
+
+// a variable, a function and a statement
+std::vector<std::string> MakeTrivial(int submissions) {
+  std::vector<std::string> snippets;
+  for (int i = 0; i < submissions; ++i) {
+    const auto n = std::to_string(i);
+    if (i % 3 == 0) {
+      snippets.push_back("int trivial" + n + " = " + n + ";");
+    } else if (i % 3 == 1) {
+      snippets.push_back("int twice" + n + "(int x) { return 2 * x; }");
+    } else {
+      snippets.push_back("trivial" + std::to_string(i - 2) + " = twice" +
+                         std::to_string(i - 1) + "(3);");
+    }
+  }
+  return snippets;
+}
+
+// a header outside of the prelude and something that uses it
+std::vector<std::string> MakeHeavyIncludes() {
+  return {"#include <regex>\nstd::regex pattern(\"a+b*\");",
+          "#include <map>\nstd::map<std::string, int> counts;",
+          "#include <unordered_map>\nstd::unordered_map<int, int> table;",
+          "#include <functional>\nstd::function<int(int)> callback;",
+          "#include <memory>\nauto shared = std::make_shared<int>(1);",
+          "#include <sstream>\nstd::ostringstream stream;",
+          "#include <random>\nstd::mt19937 engine(42);",
+          "#include <chrono>\nauto started = std::chrono::steady_clock::now();",
+          "#include <set>\nstd::set<std::string> names = {\"a\", \"b\"};",
+          "#include <thread>\nauto id = std::this_thread::get_id();"};
+}
+
+// many definitions in one snippet, the kind of code that is pasted
+std::vector<std::string> MakeDeclarations(int count, int submissions) {
+  std::vector<std::string> snippets;
+  for (int s = 0; s < submissions; ++s) {
+    std::string code;
+    for (int i = 0; i < count; ++i) {
+      const auto n = std::to_string(s) + "_" + std::to_string(i);
+      code += i % 2 ? "int value" + n + " = " + std::to_string(i) + ";\n"
+                    : "int function" + n + "(int x) { return x + " +
+                          std::to_string(i) + "; }\n";
+    }
+    snippets.push_back(code);
+  }
+  return snippets;
+}
+
+// a long session, definitions that use the ones before them and statements
+std::vector<std::string> MakeSession(int submissions) {
+  std::vector<std::string> snippets = {"std::vector<int> history;"};
+  for (int i = 1; i < submissions; ++i) {
+    const auto n = std::to_string(i);
+    const auto previous = std::to_string(i - 1);
+    switch (i % 4) {
+      case 0:
+        snippets.push_back("history.push_back(" + n + ");");
+        break;
+      case 1:
+        snippets.push_back("struct Step" + n + " { int value = " + n + "; };");
+        break;
+      case 2:
+        snippets.push_back("int step" + n + "() { return Step" + previous +
+                           "().value; }");
+        break;
+      default:
+        snippets.push_back("auto result" + n + " = step" + previous + "();");
+        break;
+    }
+  }
+  return snippets;
+}
+
+const char* kPhases[] = {"reparse", "codegen", "compile", "link",
+                         "load",    "static_init", "total"};
+
+std::vector<double> GetPhases(const rcrl::SubmitTimings& timings) {
+  std::vector<double> ms;
+  for (auto phase : {timings.reparse, timings.codegen, timings.compile,
+                     timings.link, timings.load, timings.static_init}) {
+    ms.push_back(phase.count() / 1000.0);
+  }
+  double total = 0;
+  for (auto phase : ms) {
+    total += phase;
+  }
+  ms.push_back(total);
+  return ms;
+}
+
+double Percentile(std::vector<double> ms, double q) {
+  if (ms.empty()) {
+    return 0;
+  }
+  std::sort(ms.begin(), ms.end());
+  return ms[std::min(ms.size() - 1, static_cast<size_t>(ms.size() * q))];
+}
+
+// the phases of every successful submission
+std::vector<std::vector<double>> Run(const Case& c, size_t& failed) {
+  std::vector<std::vector<double>> samples(std::size(kPhases));
+  rcrl::Plugin plugin;
+  plugin.set_phase_timing(true);
+  plugin.set_program_output_limit(4096, rcrl::Truncation::kKeepTail);
+  for (const auto& snippet : c.snippets) {
+    int exitcode = 0;
+    plugin.CompileCode(snippet);
+    // the phases are timed by the plugin, polling doesn't add to them
+    while (!plugin.TryGetExitStatusFromCompile(exitcode)) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (exitcode) {
+      std::fprintf(stderr, "%s: failed to compile\n%s\n", c.name,
+                   plugin.get_new_compiler_output().c_str());
+      failed++;
+      continue;
+    }
+    plugin.CopyAndLoadNewPlugin(true);
+    const auto phases = GetPhases(plugin.get_last_timings());
+    for (size_t p = 0; p < phases.size(); ++p) {
+      samples[p].push_back(phases[p]);
+    }
+  }
+  plugin.CleanupPlugins(true);
+  return samples;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const std::string json_file = argc > 1 ? argv[1] : "rcrl_bench.json";
+  const int session = argc > 2 ? std::atoi(argv[2]) : 500;
+  const std::vector<Case> cases = {
+      {"trivial", MakeTrivial(60)},
+      {"heavy_includes", MakeHeavyIncludes()},
+      {"declarations_1k", MakeDeclarations(1000, 5)},
+      {"declarations_10k", MakeDeclarations(10000, 2)},
+      {"session", MakeSession(session)}};
+
+  std::ofstream json(json_file, std::fstream::out | std::fstream::trunc);
+  json << "{\n  \"version\": \"" VERSION_STRING "\",\n  \"cases\": [";
+  for (size_t i = 0; i < cases.size(); ++i) {
+    const auto& c = cases[i];
+    size_t failed = 0;
+    const auto start = std::chrono::steady_clock::now();
+    const auto samples = Run(c, failed);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::printf("%s: %zu submissions, %zu failed, %.1f s\n", c.name,
+                c.snippets.size(), failed, elapsed.count());
+    json << (i ? "," : "") << "\n    {\"name\": \"" << c.name
+         << "\", \"submissions\": " << c.snippets.size()
+         << ", \"failed\": " << failed << ", \"phases\": {";
+    for (size_t p = 0; p < std::size(kPhases); ++p) {
+      const auto p50 = Percentile(samples[p], 0.5);
+      const auto p99 = Percentile(samples[p], 0.99);
+      std::printf("  %-12s p50 %9.3f ms  p99 %9.3f ms\n", kPhases[p], p50,
+                  p99);
+      json << (p ? ", " : "") << "\"" << kPhases[p] << "\": {\"p50_ms\": "
+           << p50 << ", \"p99_ms\": " << p99 << "}";
+    }
+    json << "}}";
+  }
+  json << "\n  ]\n}\n";
+  std::printf("written to %s\n", json_file.c_str());
+  return 0;
+}
@@ -0,0 +1,56 @@
+// compares a direct call with the call through a trampoline slot that the
+// functions of the snippets get, see TrampolineTable
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#include "rcrl/rcrl_trampoline.h"
+
+namespace {
+
+using Function = unsigned(unsigned);
+
+// unsigned, so the arithmetic wraps instead of overflowing
+__attribute__((noinline)) unsigned Next(unsigned x) {
+  return x * 1103515245u + 12345u;
+}
+
+// what the parser generates for an exported function of a snippet
+__attribute__((noinline)) unsigned NextThroughSlot(void** slot, unsigned x) {
+  return reinterpret_cast<Function*>(__atomic_load_n(slot, __ATOMIC_ACQUIRE))(
+      x);
+}
+
+template <class Call>
+double NanosecondsPerCall(long calls, Call call) {
+  unsigned x = 1;
+  auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < calls; ++i) {
+    x = call(x);
+  }
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+  // keeps the loop from being optimized away
+  if (x == 0) {
+    std::puts("");
+  }
+  return elapsed.count() / calls;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const long calls = argc > 1 ? std::atol(argv[1]) : 100000000;
+  rcrl::TrampolineTable table;
+  void** slot = table.GetSlot("Next", "unsigned int (unsigned int)");
+  __atomic_store_n(slot, reinterpret_cast<void*>(&Next), __ATOMIC_RELEASE);
+
+  double direct = NanosecondsPerCall(calls, [](unsigned x) { return Next(x); });
+  double dispatched = NanosecondsPerCall(
+      calls, [slot](unsigned x) { return NextThroughSlot(slot, x); });
+  std::printf("calls:       %ld\n", calls);
+  std::printf("direct:      %.3f ns/call\n", direct);
+  std::printf("trampoline:  %.3f ns/call\n", dispatched);
+  std::printf("overhead:    %.3f ns/call\n", dispatched - direct);
+  return 0;
+}
@@ -21,11 +21,29 @@ using std::endl;
 using std::string;
 int main() {
   bool console_visible = true;
+  // spans of the submissions in an overlay, see rcrl_trace.h
+  bool trace_visible = false;
+  // clang's -ftime-trace summed over the session, see rcrl_time_trace.h
+  bool time_trace_visible = false;
   // Compiler
   char flags[255] = "";
   std::vector<string> args = {"-std=c++17", "-O0",    "-Wall",
                               "-Wextra",    "-ggdb3", "-lm"};
-  rcrl::Plugin compiler(rcrl::kRcrlOutputDir / "plugin", args);
+  // host_app.h is used by nearly every snippet so precompile it with the std
+  // headers
+  auto prelude = rcrl::kRcrlDefaultPrelude;
+  prelude.emplace_back("\"" CMAKE_SOURCE_DIR "/src/host_app.h\"");
+  // a private session directory so several consoles can run side by side
+  rcrl::Plugin compiler(fs::path(), args, prelude);
+  // replayed snippets are loaded without compiling
+  compiler.set_artifact_cache(rcrl::kRcrlOutputDir / "rcrl_cache", 256 << 20);
+  // a runaway template instantiation shouldn't take the whole machine
+  rcrl::CompileLimits limits;
+  limits.timeout = std::chrono::seconds(60);
+  limits.max_memory = uintmax_t(4) << 30;
+  compiler.set_compile_limits(limits);
+  // a snippet printing in a loop shouldn't eat the memory
+  compiler.set_program_output_limit(1 << 20, rcrl::Truncation::kKeepTail);
 
   // Setup SDL
   // (Some versions of SDL before <2.0.10 appears to have performance/stalling
@@ -138,6 +156,8 @@ std::cout << vec.size() << std::endl;
 
   // holds the exit code from the last compilation - there was an error when not
   int last_compiler_exitcode = 0;
+  // errors of the last compile by line of the submitted code
+  TextEditor::ErrorMarkers code_markers;
 
   // limiting to 50 fps because on some systems the whole machine started
   // lagging when the demo was turned on
@@ -215,6 +235,17 @@ std::cout << vec.size() << std::endl;
       program_output.SetBreakpoints(bps);
     };
 
+    // append what the running snippets printed since the last frame
+    auto new_program_output = compiler.get_new_program_output();
+    if (new_program_output.size()) {
+      auto old_line_count = program_output.GetTotalLines();
+      auto len = program_output.GetText().length();
+      program_output.SetText(program_output.GetText().substr(0, --len) +
+                             new_program_output);
+      // highlight the new stdout lines
+      do_breakpoints_on_output(old_line_count, new_program_output);
+    }
+
     // console setup
     if (console_visible &&
         ImGui::Begin("console", nullptr,
@@ -235,37 +266,20 @@ std::cout << vec.size() << std::endl;
       ImGui::BeginChild("compiler output", ImVec2(0, text_field_height));
       auto new_output = compiler.get_new_compiler_output();
       if (new_output.size()) {
-        auto total_output = compiler_output.GetText() + new_output;
-
-        // scan for errors through the lines and highlight them with markers
-        auto curr_pos = 0;
-        auto line = 1;
-        auto first_error_marker_line = 0;
-        TextEditor::ErrorMarkers error_markers;
-        do {
-          auto new_curr_pos_1 = total_output.find(
-              "error", curr_pos + 1);  // add 1 to skip new lines
-          auto new_curr_pos_2 =
-              total_output.find("\n", curr_pos + 1);  // add 1 to skip new lines
-          if (new_curr_pos_1 < new_curr_pos_2) {
-            error_markers.insert(std::make_pair(line, ""));
-            if (!first_error_marker_line) first_error_marker_line = line;
-          }
-          if (new_curr_pos_2 < new_curr_pos_1) {
-            line++;
-          }
-          curr_pos = std::min(new_curr_pos_1, new_curr_pos_2);
-        } while (size_t(curr_pos) != string::npos);
-        compiler_output.SetErrorMarkers(error_markers);
-
-        // update compiler output
-        compiler_output.SetText(move(total_output));
-        if (first_error_marker_line)
-          compiler_output.SetCursorPosition({first_error_marker_line, 1});
-        else
-          compiler_output.SetCursorPosition(
-              {compiler_output.GetTotalLines(), 1});
+        // append at the end instead of replacing the whole text
+        compiler_output.SetCursorPosition({compiler_output.GetTotalLines(), 0});
+        compiler_output.InsertText(new_output);
+        compiler_output.SetCursorPosition({compiler_output.GetTotalLines(), 0});
+      }
+      // mark the erroneous lines of the submitted code
+      auto new_diagnostics = compiler.get_new_diagnostics();
+      for (const auto &d : new_diagnostics) {
+        if (d.code_line && d.severity >= rcrl::Severity::kError) {
+          auto &marker = code_markers[d.code_line];
+          marker += (marker.empty() ? "" : "\n") + d.message;
+        }
       }
+      if (new_diagnostics.size()) editor.SetErrorMarkers(code_markers);
       if (last_compiler_exitcode)
         ImGui::TextColored({1, 0, 0, 1}, "Compiler output - ERROR!");
       else
@@ -285,6 +299,24 @@ std::cout << vec.size() << std::endl;
                   ecpos.mColumn + 1, editor.GetTotalLines(),
                   editor.CanUndo() ? "*" : " ");
       editor.Render("Code");
+      // Ctrl+Space completes the word at the cursor, the column of the editor
+      // counts a tab as several characters but snippets hardly have any
+      if (io.KeyCtrl && ImGui::IsKeyPressed(SDL_SCANCODE_SPACE, false)) {
+        auto cursor = editor.GetCursorPosition();
+        compiler.RequestCompletion(editor.GetText(), cursor.mLine + 1,
+                                   cursor.mColumn + 1);
+      }
+      static std::vector<rcrl::Completion> completions;
+      if (compiler.TryGetCompletions(completions) && completions.size())
+        ImGui::OpenPopup("completions");
+      if (ImGui::BeginPopup("completions")) {
+        for (size_t i = 0; i < completions.size() && i < 50; ++i) {
+          const auto &completion = completions[i];
+          if (ImGui::Selectable(completion.signature.c_str()))
+            editor.InsertText(completion.text.substr(completion.typed));
+        }
+        ImGui::EndPopup();
+      }
       ImGui::EndChild();
       ImGui::SameLine();
       // bottom right part
@@ -319,6 +351,8 @@ std::cout << vec.size() << std::endl;
                      angles[((int)(t * angular_velocity)) % 8]);
         ImGui::SetCursorPosX(ImGui::GetCursorPosX() +
                              ImGui::GetTextLineHeight() * scale + 5);
+        if (ImGui::Button("Cancel")) compiler.CancelCompile();
+        ImGui::SameLine();
       }
       // input for compiler flags with button to set it
       ImGui::Text("Compiler flags:");
@@ -342,19 +376,43 @@ std::cout << vec.size() << std::endl;
       ImGui::SameLine();
       if (ImGui::Button("Cleanup Plugins") && !compiler.IsCompiling()) {
         compiler_output.SetText("");
-        auto output_from_cleanup = compiler.CleanupPlugins(true);
-        auto old_line_count = program_output.GetTotalLines();
-        program_output.SetText(program_output.GetText() + output_from_cleanup);
+        // the output shows up with the next frame
+        compiler.CleanupPlugins(true);
         program_output.SetCursorPosition({program_output.GetTotalLines(), 0});
 
         last_compiler_exitcode = 0;
-
-        // highlight the new stdout lines
-        do_breakpoints_on_output(old_line_count, output_from_cleanup);
       }
       ImGui::SameLine();
       if (ImGui::Button("Clear Output")) program_output.SetText("");
       ImGui::SameLine();
+      // compile the code in the background once typing pauses
+      static bool speculate = false;
+      ImGui::Checkbox("Speculate", &speculate);
+      static auto last_edit = std::chrono::steady_clock::now();
+      if (editor.IsTextChanged() && !compiler.IsCompiling()) {
+        last_edit = std::chrono::steady_clock::now();
+        // the text it is compiling is already stale
+        compiler.CancelSpeculation(false);
+      }
+      if (speculate && editor.GetText().size() > 1 &&
+          std::chrono::steady_clock::now() - last_edit >
+              std::chrono::milliseconds(500)) {
+        // a no-op while the same text is being or was speculated
+        compiler.CompileSpeculatively(editor.GetText());
+      }
+      ImGui::SameLine();
+      if (ImGui::Checkbox("Trace", &trace_visible))
+        rcrl::SetTracing(trace_visible);
+      ImGui::SameLine();
+      // the flags of a compile can't change while it runs
+      if (ImGui::Checkbox("Time trace", &time_trace_visible)) {
+        if (compiler.IsCompiling()) {
+          time_trace_visible = !time_trace_visible;
+        } else {
+          compiler.set_time_trace(time_trace_visible);
+        }
+      }
+      ImGui::SameLine();
       ImGui::Dummy({20, 0});
       ImGui::SameLine();
       ImGui::Text("Use Ctrl+Enter to submit code");
@@ -362,6 +420,8 @@ std::cout << vec.size() << std::endl;
       if (compile && !compiler.IsCompiling() && editor.GetText().size() > 1) {
         // clear compiler output
         compiler_output.SetText("");
+        code_markers.clear();
+        editor.SetErrorMarkers(code_markers);
         if (compiler.CompileCode(editor.GetText())) {
           // make the editor code untouchable while compiling
           editor.SetReadOnly(true);
@@ -372,6 +432,69 @@ std::cout << vec.size() << std::endl;
       ImGui::End();
     }
 
+    // the latest spans, newest first, exported for Perfetto
+    if (trace_visible) {
+      ImGui::SetNextWindowBgAlpha(0.8f);
+      if (ImGui::Begin("trace", &trace_visible,
+                       ImGuiWindowFlags_AlwaysAutoResize)) {
+        static string trace_file;
+        if (ImGui::Button("Export")) {
+          trace_file = (rcrl::kRcrlOutputDir / "rcrl_trace.json").string();
+          if (!rcrl::WriteChromeTrace(trace_file)) trace_file = "failed";
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Clear")) rcrl::ClearTrace();
+        ImGui::SameLine();
+        ImGui::Text("%s", trace_file.c_str());
+        // collecting copies every buffer, a few times a second is enough
+        static std::vector<rcrl::TraceEvent> events;
+        static auto last_collect = std::chrono::steady_clock::time_point();
+        if (std::chrono::steady_clock::now() - last_collect >
+            std::chrono::milliseconds(250)) {
+          events = rcrl::GetTraceEvents();
+          last_collect = std::chrono::steady_clock::now();
+        }
+        for (size_t i = 0; i < events.size() && i < 40; ++i) {
+          const auto &event = events[events.size() - 1 - i];
+          ImGui::Text("%10.3f ms  thread %2u  %s",
+                      event.duration.count() / 1e6, event.thread,
+                      event.name);
+        }
+      }
+      ImGui::End();
+      // closed with the x of the window
+      if (!trace_visible) rcrl::SetTracing(false);
+    }
+
+    // the most expensive headers and templates of the session and the
+    // latest snippets
+    if (time_trace_visible) {
+      ImGui::SetNextWindowBgAlpha(0.8f);
+      if (ImGui::Begin("time trace", &time_trace_visible,
+                       ImGuiWindowFlags_AlwaysAutoResize)) {
+        const auto report = compiler.get_time_trace_report(10);
+        ImGui::Text("headers, parse time including their includes");
+        for (const auto &entry : report.headers)
+          ImGui::Text("%10.3f ms %4zu x  %s", entry.total.count() / 1e3,
+                      entry.count, entry.name.c_str());
+        ImGui::Text("templates, instantiation time");
+        for (const auto &entry : report.templates)
+          ImGui::Text("%10.3f ms %4zu x  %.80s", entry.total.count() / 1e3,
+                      entry.count, entry.name.c_str());
+        ImGui::Text("snippets, frontend and backend time");
+        for (const auto &snippet : report.snippets)
+          ImGui::Text("%4zu %10.3f ms %10.3f ms  %.40s", snippet.compile,
+                      snippet.frontend.count() / 1e3,
+                      snippet.backend.count() / 1e3, snippet.code.c_str());
+      }
+      ImGui::End();
+      // closed with the x of the window, not while a compile runs
+      if (!time_trace_visible && compiler.IsCompiling())
+        time_trace_visible = true;
+      else if (!time_trace_visible)
+        compiler.set_time_trace(false);
+    }
+
     // if there is a spawned compiler process and it has just finished
     if (compiler.TryGetExitStatusFromCompile(last_compiler_exitcode)) {
       // we can edit the code again
@@ -392,19 +515,9 @@ std::cout << vec.size() << std::endl;
 
         // load the new plugin
         static std::future<int> f_output;
+        // its output is streamed to the program output every frame
         f_output = std::async(std::launch::async, [&]() {
-          auto output_from_loading = compiler.CopyAndLoadNewPlugin(true);
-          auto old_line_count = program_output.GetTotalLines();
-          auto len = program_output.GetText().length();
-          program_output.SetText(program_output.GetText().substr(0, --len) +
-                                 output_from_loading);
-          // TODO: used for auto-scroll but the cursor in the editor is removed
-          // (unfocused) sometimes from this...
-          // program_output.SetCursorPosition({program_output.GetTotalLines(),
-          // 0});
-
-          // highlight the new stdout lines
-          do_breakpoints_on_output(old_line_count, output_from_loading);
+          compiler.CopyAndLoadNewPlugin(true);
           return 0;
         });
         // clear the editor
@@ -6,6 +6,8 @@
 #include <algorithm>
 #include <cassert>
 #include <chrono>
+#include <csignal>
+#include <cstdlib>
 #include <fstream>
 #include <future>
 #include <iostream>
@@ -28,6 +30,10 @@ typedef HMODULE RCRL_Dynlib;
 #else
 
 #include <dlfcn.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+#include <unistd.h>
 typedef void* RCRL_Dynlib;
 #define RDRL_LoadDynlib(lib) dlopen(lib, RTLD_LAZY | RTLD_GLOBAL)
 #define RCRL_CloseDynlib dlclose
@@ -52,25 +58,482 @@ auto CopyFileToString(const string& f_name) {
   fclose(f);
   return out;
 }
-Plugin::Plugin(fs::path file, std::vector<string> flags)
-    : is_compiling_(false), parser_(file.string() + ".cpp", flags) {
+bool IsSharedObject(int fd) {
+  const char elf_magic[] = {0x7f, 'E', 'L', 'F'};
+  char magic[sizeof(elf_magic)];
+  return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+         std::equal(magic, magic + sizeof(magic), elf_magic);
+}
+#ifdef __linux__
+// whether the linker can write a plugin through the /proc path of a memfd,
+// found out once per process by linking an empty library into one
+bool CanLinkIntoMemfd() {
+  static const bool can_link = []() {
+    const int fd = memfd_create(RCRL_PLUGIN_NAME, MFD_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    bp::child c(bp::search_path("clang++").string() +
+                    " -shared -x c++ /dev/null -o /proc/" +
+                    std::to_string(getpid()) + "/fd/" + std::to_string(fd),
+                bp::std_out > bp::null, bp::std_err > bp::null);
+    c.wait();
+    const bool linked = c.exit_code() == 0 && IsSharedObject(fd);
+    close(fd);
+    return linked;
+  }();
+  return can_link;
+}
+#endif
+size_t CountMappings() {
+  std::ifstream maps("/proc/self/maps");
+  return std::count(std::istreambuf_iterator<char>(maps),
+                    std::istreambuf_iterator<char>(), '\n');
+}
+bool IsLinkerFlag(const string& flag) {
+  return flag.rfind("-l", 0) == 0 || flag.rfind("-L", 0) == 0 ||
+         flag.rfind("-Wl,", 0) == 0;
+}
+std::chrono::microseconds ElapsedSince(
+    std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+}
+// the driver or the frontend it spawns, e.g. clang++ or clang-18. A linker
+// may live next to them, e.g. /usr/lib/llvm-18/bin/ld.lld, so only the name
+// of the executable counts
+bool IsClang(const string& executable) {
+  const auto name = executable.substr(executable.find_last_of('/') + 1);
+  for (const string clang : {"clang++", "clang"}) {
+    if (name == clang ||
+        (name.size() > clang.size() + 1 && name.rfind(clang + "-", 0) == 0 &&
+         name.find_first_not_of("0123456789", clang.size() + 1) ==
+             string::npos)) {
+      return true;
+    }
+  }
+  return false;
+}
+// time of the linker in a -fproc-stat-report file. The lines are
+// executable,output,total,user,memory with the times in microseconds, the
+// frontend usually runs inside of clang++ and has none
+std::chrono::microseconds ReadLinkTime(const fs::path& file) {
+  std::ifstream report(file);
+  std::chrono::microseconds total{0};
+  string line;
+  while (std::getline(report, line)) {
+    if (IsClang(line.substr(0, line.find(',')))) {
+      continue;
+    }
+    // the output may have commas, the three numbers at the end don't
+    auto comma = line.size();
+    for (int field = 0; field < 3 && comma != string::npos; ++field) {
+      comma = comma ? line.rfind(',', comma - 1) : string::npos;
+    }
+    if (comma != string::npos) {
+      total += std::chrono::microseconds(std::atoll(line.c_str() + comma + 1));
+    }
+  }
+  return total;
+}
+
+fs::path NewSessionDirectory() {
+  static std::atomic<unsigned> session_count(0);
+  // the pid keeps sessions of different processes apart
+  auto dir = kRcrlOutputDir / ("rcrl_session_" + std::to_string(getpid()) +
+                               "_" + std::to_string(session_count++));
+  fs::create_directories(dir);
+  return dir;
+}
+
+Plugin::Plugin(fs::path file, std::vector<string> flags,
+               std::vector<string> prelude)
+    : session_dir_(file.empty() ? NewSessionDirectory() : file.parent_path()),
+      owns_session_dir_(file.empty()),
+      is_compiling_(false),
+      parser_((file.empty() ? session_dir_ / "plugin" : file).string() +
+                  ".cpp",
+              flags),
+      prelude_file_(session_dir_ / (parser_.get_file().stem().string() +
+                                    "_prelude.hpp")) {
+  // nothing is parsed before the first request, the file of the parser
+  // exists, which libclang needs for a preamble
+  completion_ = std::make_unique<CompletionEngine>(parser_.get_file(),
+                                                   parser_.get_flags());
+  static std::atomic<unsigned> plugin_count(0);
+  parser_.set_session("__rcrl_session_" + std::to_string(plugin_count++));
+  set_prelude(prelude);
+  ResetHeaderFile();
+}
+Plugin::~Plugin() {
+  // the compile task uses this plugin, it goes first
+  CancelCompile();
+  if (compiler_process_.valid()) {
+    compiler_process_.wait();
+  }
+  // before the cleanup, which would rebuild its preamble for nothing
+  completion_.reset();
+  CancelSpeculation();
+  if (flags_process_.valid()) {
+    flags_process_.wait();
+  }
+  CleanupPlugins();
+  if (output_fd_ >= 0) {
+    close(output_fd_);
+  }
+  if (owns_session_dir_) {
+    std::error_code ec;
+    fs::remove_all(session_dir_, ec);
+  }
+}
+
+void Plugin::ResetHeaderFile() {
+  for (const auto& header : header_chain_) {
+    std::error_code ec;
+    fs::remove(header, ec);
+    fs::remove(header.string() + ".pch", ec);
+  }
+  header_chain_.clear();
+  header_pch_count_ = 0;
+  header_pch_failed_ = false;
+  WriteHeaderFile();
+}
+
+void Plugin::WriteHeaderFile() {
   auto header = parser_.get_file().replace_extension(".hpp");
+  const auto& last =
+      header_chain_.empty() ? prelude_file_ : header_chain_.back();
   std::ofstream f(header, std::fstream::trunc | std::fstream::out);
   f << "#pragma once\n";
-  f.close();
+  // every header of the chain includes the one before it
+  f << "#include \"" << last.filename().string() << "\"\n";
+  // already gone when the destructor cleans up
+  if (completion_) {
+    completion_->Invalidate(parser_.get_flags());
+  }
+}
+
+void Plugin::AppendHeaderFile() {
+  const auto& previous =
+      header_chain_.empty() ? prelude_file_ : header_chain_.back();
+  auto header = session_dir_ / (parser_.get_file().stem().string() + "_" +
+                                std::to_string(header_chain_.size()) + ".hpp");
+  {
+    std::ofstream f(header, std::fstream::trunc | std::fstream::out);
+    f << "#pragma once\n";
+    // guarded, so it is skipped when the previous pch is already included
+    f << "#include \"" << previous.filename().string() << "\"\n";
+  }
+  parser_.GenerateHeaderFile(header.string());
+  header_chain_.push_back(header);
+  WriteHeaderFile();
+}
+
+void Plugin::set_prelude(const std::vector<string>& headers) {
+  assert(!IsCompiling());
+  CancelSpeculation();
+  prelude_ = headers;
+  // guarded by a macro too, so that a parse service can precompile the text
+  // once for many sessions and the copy of each session is skipped
+  std::ostringstream text;
+  text << "#pragma once\n"
+       << "#ifndef RCRL_PRELUDE_HPP\n"
+       << "#define RCRL_PRELUDE_HPP\n"
+       << "// functions marked with it are called directly, not redefinable\n"
+       << "#define RCRL_DIRECT __attribute__((annotate(\"rcrl_direct\")))\n"
+       << "// spells a type the parser printed so that it reads as one\n"
+       << "template <class T>\nusing __rcrl_type = T;\n";
+  for (const auto& header : prelude_) {
+    text << "#include " << header << "\n";
+  }
+  text << "#endif\n";
+  std::ofstream(prelude_file_, std::fstream::trunc | std::fstream::out)
+      << text.str();
+  if (flags_process_.valid()) {
+    flags_process_.wait();
+  }
+  parser_.set_prelude(text.str());
+  completion_->Invalidate(parser_.get_flags());
+}
+
+bool Plugin::set_backend(Backend backend) {
+  assert(!IsCompiling());
+  if ((backend == Backend::kJit && !JitEngine::IsAvailable()) ||
+      (backend == Backend::kServer && !CompileServer::IsAvailable())) {
+    return false;
+  }
+  CleanupPlugins();
+  if (backend == Backend::kJit && !jit_) {
+    jit_ = std::make_unique<JitEngine>();
+  }
+#ifdef RCRL_COMPILE_SERVER
+  if (backend == Backend::kServer && !server_) {
+    server_ = std::make_unique<CompileServer>(RCRL_COMPILE_SERVER);
+  }
+#endif
+  backend_ = backend;
+  return true;
+}
+
+std::vector<string> Plugin::GetCompileFlags(bool with_linker_flags) {
+  std::vector<string> flags;
+  for (const auto& flag : parser_.get_flags()) {
+    if (with_linker_flags || !IsLinkerFlag(flag)) {
+      flags.emplace_back(flag);
+    }
+  }
+  flags.emplace_back("-fvisibility=hidden");
+  flags.emplace_back("-fPIC");
+  return flags;
+}
+
+std::vector<fs::path> Plugin::FindPreludeHeaders() {
+  // quoted headers are looked up next to the prelude first
+  std::vector<fs::path> quoted_dirs = {session_dir_};
+  std::vector<fs::path> dirs;
+  const auto flags = parser_.get_flags();
+  for (size_t i = 0; i < flags.size(); ++i) {
+    for (const string option : {"-I", "-isystem", "-iquote"}) {
+      if (flags[i].rfind(option, 0) != 0) {
+        continue;
+      }
+      auto dir = flags[i].substr(option.size());
+      if (dir.empty() && i + 1 < flags.size()) {
+        dir = flags[++i];
+      }
+      (option == "-iquote" ? quoted_dirs : dirs).emplace_back(dir);
+      break;
+    }
+  }
+  std::vector<fs::path> headers;
+  for (const auto& header : prelude_) {
+    if (header.size() < 3) {
+      continue;
+    }
+    const fs::path name = header.substr(1, header.size() - 2);
+    auto candidates = header[0] == '"' ? quoted_dirs : std::vector<fs::path>();
+    candidates.insert(candidates.end(), dirs.begin(), dirs.end());
+    if (name.is_absolute()) {
+      candidates = {fs::path()};
+    }
+    for (const auto& dir : candidates) {
+      std::error_code ec;
+      if (fs::is_regular_file(dir / name, ec)) {
+        headers.push_back(dir / name);
+        break;
+      }
+    }
+  }
+  return headers;
+}
+
+string Plugin::GetPreludeStamp() {
+  string stamp;
+  for (const auto& header : FindPreludeHeaders()) {
+    std::error_code ec;
+    const auto size = fs::file_size(header, ec);
+    const auto time = fs::last_write_time(header, ec);
+    stamp += header.string() + " " + std::to_string(size) + " " +
+             std::to_string(time.time_since_epoch().count()) + "\n";
+  }
+  return stamp;
+}
+
+bool Plugin::PchOutOfDate() {
+  std::lock_guard<std::mutex> lock(compiler_output_mut_);
+  return compiler_output_.find(
+             "has been modified since the precompiled header") !=
+         string::npos;
+}
+
+void Plugin::UpdatePrecompiledPrelude(CompileJob& job) {
+  // the pch is only accepted by clang when built with the same flags and
+  // headers that didn't change since
+  string key;
+  for (const auto& flag : GetCompileFlags()) {
+    key += flag + " ";
+  }
+  for (const auto& header : prelude_) {
+    key += "\n" + header;
+  }
+  key += "\n" + GetPreludeStamp();
+  // the in process frontend and clang++ may differ in version
+  key += backend_ == Backend::kProcess ? "\nprocess" : "\nin process";
+  if (key == prelude_pch_key_) {
+    return;
+  }
+  prelude_pch_key_ = key;
+  prelude_pch_valid_ = false;
+  // the chain is built on top of the prelude pch
+  header_pch_count_ = 0;
+  header_pch_failed_ = false;
+  if (prelude_.empty()) {
+    return;
+  }
+  // a broken prelude only costs the speedup, plugins still compile without it
+  prelude_pch_valid_ = BuildPch(prelude_file_, fs::path(), job);
+  if (job.IsCancelled()) {
+    // retry with the next compile
+    prelude_pch_key_.clear();
+  }
+}
+
+void Plugin::UpdatePrecompiledHeaders(CompileJob& job) {
+  // one pch per submission, each chained to the one before, so a compile
+  // only parses the declarations of the last submission
+  while (!header_pch_failed_ && header_pch_count_ < header_chain_.size()) {
+    if (!BuildPch(header_chain_[header_pch_count_], GetPchFile(), job)) {
+      // the rest of the chain is parsed as text until the next reset
+      header_pch_failed_ = !job.IsCancelled();
+      return;
+    }
+    ++header_pch_count_;
+  }
+}
+
+fs::path Plugin::GetPchFile() {
+  if (header_pch_count_ > 0) {
+    return header_chain_[header_pch_count_ - 1].string() + ".pch";
+  }
+  return prelude_pch_valid_ ? fs::path(prelude_file_.string() + ".pch")
+                            : fs::path();
+}
+
+bool Plugin::BuildPch(const fs::path& header, const fs::path& base_pch,
+                      CompileJob& job) {
+  TraceScope trace("BuildPch");
+  const auto pch = header.string() + ".pch";
+  auto flags = GetCompileFlags(false);
+  if (!base_pch.empty()) {
+    // clang writes a chained pch that only holds what header adds
+    flags.emplace_back("-include-pch");
+    flags.emplace_back(base_pch.string());
+  }
+  if (backend_ != Backend::kProcess) {
+    string output;
+    int exit_code;
+    if (backend_ == Backend::kJit) {
+      exit_code = jit_->BuildPch(header.string(), pch, flags, output);
+    } else {
+      CompileRequest request;
+      request.command = "pch";
+      request.input = header.string();
+      request.output = pch;
+      request.flags = flags;
+      exit_code = server_->Send(request, output, job);
+    }
+    std::lock_guard<std::mutex> lock(compiler_output_mut_);
+    compiler_output_ += output;
+    return exit_code == 0;
+  }
+  auto cmd = bp::search_path("clang++").string() + string(" -x c++-header ");
+  for (const auto& flag : flags) {
+    cmd += flag + string(" ");
+  }
+  cmd += header.string() + " -o " + pch;
+  return RunCompiler(cmd, job) == 0;
+}
+
+int Plugin::CompileInProcess() {
+  TraceScope trace("CompileInProcess");
+  auto flags = GetCompileFlags(false);
+  const auto pch = GetPchFile();
+  if (!pch.empty()) {
+    flags.emplace_back("-include-pch");
+    flags.emplace_back(pch.string());
+  }
+  flags.emplace_back("--serialize-diagnostics");
+  flags.emplace_back(GetDiagnosticsFile().string());
+  string output;
+  auto exit_code = jit_->Compile(parser_.get_generated_source(),
+                                 parser_.get_file().string(), flags, output);
+  std::lock_guard<std::mutex> lock(compiler_output_mut_);
+  compiler_output_ += output;
+  return exit_code;
+}
+
+int Plugin::CompileOnServer(CompileJob& job) {
+  TraceScope trace("CompileOnServer");
+  CompileRequest request;
+  request.command = "compile";
+  request.input = parser_.get_file().string();
+  request.output = compiled_artifact_.string();
+  request.flags = GetCompileFlags(false);
+  const auto pch = GetPchFile();
+  if (!pch.empty()) {
+    request.flags.emplace_back("-include-pch");
+    request.flags.emplace_back(pch.string());
+  }
+  request.flags.emplace_back("--serialize-diagnostics");
+  request.flags.emplace_back(GetDiagnosticsFile().string());
+  for (const auto& flag : parser_.get_flags()) {
+    if (IsLinkerFlag(flag)) {
+      request.link_flags.emplace_back(flag);
+    }
+  }
+  request.link_flags.insert(request.link_flags.end(),
+                            {"-Wl,-undefined,error", "-Wl,-flat_namespace"});
+  request.source = parser_.get_generated_source();
+  string output;
+  auto exit_code = server_->Send(request, output, job);
+  std::lock_guard<std::mutex> lock(compiler_output_mut_);
+  compiler_output_ += output;
+  return exit_code;
+}
+
+int Plugin::RunCompiler(const string& cmd, CompileJob& job, string* output,
+                        const string* input) {
+  TraceScope trace("clang++");
+  return job.Run(
+      cmd,
+      [&](const char* data, size_t size) {
+        if (output) {
+          output->append(data, size);
+        } else {
+          std::lock_guard<std::mutex> lock(compiler_output_mut_);
+          compiler_output_.append(data, size);
+        }
+      },
+      input);
 }
-Plugin::~Plugin() { CleanupPlugins(); }
 void Plugin::set_flags(const std::vector<string>& new_flags) {
-  // avoid calling it's constructor at the function end
-  static std::future<bool> p;
   assert(!IsCompiling());
+  CancelSpeculation();
+  completion_->Invalidate(new_flags);
+  // a recently used flag set still has its translation unit
+  if (parser_.HasUnit(new_flags)) {
+    parser_.set_flags(new_flags);
+    return;
+  }
   is_compiling_ = true;
-  p = std::async(std::launch::async, [&]() {
+  // kept as a member to avoid blocking in its destructor at the function end
+  flags_process_ = std::async(std::launch::async, [this, new_flags]() {
     parser_.set_flags(new_flags);
     return (is_compiling_ = false);
   });
 }
 
+void Plugin::RequestCompletion(string code, unsigned int line,
+                               unsigned int column) {
+  // one line for the include of plugin.hpp
+  completion_->Request(GetParsedSource(code), line + 1, column);
+}
+
+bool Plugin::TryGetCompletions(std::vector<Completion>& completions) {
+  return completion_->TryGetResults(completions);
+}
+
+void Plugin::set_parse_cache_size(size_t units) {
+  assert(!IsCompiling());
+  CancelSpeculation();
+  parser_.set_max_units(units);
+}
+
+std::vector<UnitStats> Plugin::get_parse_cache_stats() {
+  assert(!IsCompiling());
+  return parser_.GetUnitStats();
+}
+
 string Plugin::get_new_compiler_output() {
   std::lock_guard<std::mutex> lock(compiler_output_mut_);
   auto str = compiler_output_;
@@ -78,50 +541,79 @@ string Plugin::get_new_compiler_output() {
   return str;
 }
 
-string Plugin::CleanupPlugins(bool redirect_stdout) {
-  assert(!IsCompiling());
-
-  int fd;
-  fpos_t pos;
-  if (redirect_stdout) {
-    fgetpos(stdout, &pos);
-    fd = dup(fileno(stdout));
-    freopen(kRcrlOutputFile.c_str(), "w", stdout);
+string Plugin::RunWithStdoutCapture(bool redirect_stdout,
+                                    const std::function<void()>& run) {
+  if (!redirect_stdout) {
+    run();
+    return string();
   }
+  BoundedOutput out;
+  {
+    std::lock_guard<std::mutex> lock(program_output_mut_);
+    out.set_limit(program_output_limit_, program_output_truncation_);
+  }
+  {
+    StdoutCapture capture([&](const char* data, size_t size) {
+      out.Append(data, size);
+      std::lock_guard<std::mutex> lock(program_output_mut_);
+      program_output_.Append(data, size);
+    });
+    run();
+  }
+  return out.Take();
+}
 
-  // close the plugins_ in reverse order
-  for (auto it = plugins_.rbegin(); it != plugins_.rend(); ++it)
-    RCRL_CloseDynlib(it->second);
-
-  string out;
+string Plugin::get_new_program_output() {
+  std::lock_guard<std::mutex> lock(program_output_mut_);
+  return program_output_.Take();
+}
 
-  if (redirect_stdout) {
-    fflush(stdout);
-    dup2(fd, fileno(stdout));
-    close(fd);
-    clearerr(stdout);
-    fsetpos(stdout, &pos);
+void Plugin::set_program_output_limit(size_t max_bytes, Truncation policy) {
+  std::lock_guard<std::mutex> lock(program_output_mut_);
+  program_output_limit_ = max_bytes;
+  program_output_truncation_ = policy;
+  program_output_.set_limit(max_bytes, policy);
+}
 
-    FILE* f = fopen(kRcrlOutputFile.c_str(), "rb");
-    fseek(f, 0, SEEK_END);
-    long fsize = ftell(f);
-    fseek(f, 0, SEEK_SET);
+string Plugin::CleanupPlugins(bool redirect_stdout) {
+  TraceScope trace("CleanupPlugins");
+  assert(!IsCompiling());
+  CancelSpeculation();
 
-    out.resize(fsize);
-    fread((void*)out.data(), fsize, 1, f);
-    fclose(f);
+  // destructors of globals in the plugins may print
+  auto out = RunWithStdoutCapture(redirect_stdout, [&]() {
+    // close the plugins_ in reverse order
+    for (auto it = plugins_.rbegin(); it != plugins_.rend(); ++it)
+      RCRL_CloseDynlib(it->second);
+    if (jit_) {
+      jit_->Reset();
+    }
+  });
+  // the slots point into the closed plugins
+  if (trampolines_) {
+    trampolines_->Reset();
+  }
+  if (arena_) {
+    arena_->Reset();
   }
 
   for (const auto& [name, _] : plugins_) {
-    std::remove(name.c_str());
+    if (name.rfind("/proc/", 0) != 0) {
+      std::remove(name.c_str());
+    }
+  }
+  for (auto fd : plugin_fds_) {
+    close(fd);
   }
 
   plugins_.clear();
+  plugin_fds_.clear();
+  compaction_definitions_.clear();
+  compaction_variables_.clear();
+  compaction_error_.clear();
+  compaction_failed_ = false;
 
-  // reset header file
-  auto header = parser_.get_file().replace_extension(".hpp");
-  std::ofstream f(header, std::fstream::trunc | std::fstream::out);
-  f << "#pragma once\n";
+  ResetHeaderFile();
 
   return out;
 }
@@ -133,62 +625,465 @@ bool Plugin::CompileCode(string code) {
   // fix line endings
   replace(code.begin(), code.end(), '\r', '\n');
 
-  // figure out the sections
-  std::fstream file(parser_.get_file(),
-                    std::fstream::in | std::fstream::out | std::fstream::trunc);
-  // add header to correctly parse the input
-  auto header = parser_.get_file().stem().string() + ".hpp";
-  file << "#include \"" + header + "\"\n" << code;
-  file.close();
+  // a speculation of the same code is left running and then hits the cache
+  if (code != speculative_code_) {
+    CancelSpeculation(false);
+  }
+  speculative_code_.clear();
   // mark the successful compilation flag as false
   last_compile_successful_ = false;
-  compiler_output_.clear();
+  {
+    // the speculation left running may still be writing pch errors
+    std::lock_guard<std::mutex> lock(compiler_output_mut_);
+    compiler_output_.clear();
+    diagnostics_.clear();
+  }
   is_compiling_ = true;
-  // TODO: add buffer size to config file
-  static std::vector<char> buf(128);
-  compiler_process_ = std::async(std::launch::async, [&]() {
+  timings_ = SubmitTimings();
+  job_ = std::make_shared<CompileJob>(limits_);
+  auto task = [this, code, job = job_]() {
+    TraceScope trace("CompileCode");
+    // the speculation owns the parser and the source file until it exits
+    if (speculation_.valid()) {
+      speculation_.wait();
+    }
+    if (job->IsCancelled()) {
+      is_compiling_ = false;
+      return SIGKILL;
+    }
+    // the timeout counts from here, not from the submission
+    job->Start();
+    // figure out the sections
     // reparsing takes some time so moved inside async
-    parser_.Reparse();
-    parser_.GenerateSourceFile(parser_.get_file());
-    boost::asio::io_service ios;
-    bp::async_pipe ap(ios);
-    auto output_buffer = boost::asio::buffer(buf);
-    // must use clang++ as g++ differ from libclang deduced types
-    auto cmd = bp::search_path("clang++").string() + string(" ");
-    for (auto flag : parser_.get_flags()) {
-      cmd += flag + string(" ");
-    }
-    cmd +=
-        "-shared -Wl,-undefined,error -Wl,-flat_namespace -fvisibility=hidden "
-        "-fPIC " +
-        parser_.get_file().string() + " -o " +
-        std::string(kRcrlOutputDir /
-                    (parser_.get_file().stem().string() + ".so"));
-    bp::child c(cmd, (bp::std_err & bp::std_out) > ap, bp::std_in.close());
-    auto OnStdout = [&](const boost::system::error_code& ec, std::size_t size) {
-      auto lambda_impl = [&](const boost::system::error_code& ec, std::size_t n,
-                             auto& lambda_ref) {
+    auto start = std::chrono::steady_clock::now();
+    parser_.Reparse(GetParsedSource(code));
+    // libclang can't be stopped while it parses, so a runaway parse is only
+    // cut short after it returns
+    bool rejected = false;
+    if (preflight_ && !job->IsCancelled()) {
+      TraceScope trace("Preflight");
+      rejected = RejectedByPreflight();
+    }
+    timings_.reparse = ElapsedSince(start);
+    if (job->IsCancelled()) {
+      std::lock_guard<std::mutex> lock(compiler_output_mut_);
+      compiler_output_ += job->GetStopReason();
+      is_compiling_ = false;
+      return SIGKILL;
+    }
+    if (rejected) {
+      is_compiling_ = false;
+      return 1;
+    }
+    // kept in memory, every backend gets the source from the parser
+    start = std::chrono::steady_clock::now();
+    init_probe_ = GenerateSource();
+    timings_.codegen = ElapsedSince(start);
+    start = std::chrono::steady_clock::now();
+    UpdatePrecompiledPrelude(*job);
+    UpdatePrecompiledHeaders(*job);
+    compiled_artifact_cached_ = false;
+    // the jit has no artifact to cache
+    string artifact_key;
+    if (cache_ && backend_ != Backend::kJit) {
+      TraceScope trace("ArtifactCache::Lookup");
+      artifact_key = GetArtifactKey();
+      auto cached = cache_->Lookup(artifact_key);
+      if (!cached.empty()) {
         std::lock_guard<std::mutex> lock(compiler_output_mut_);
-        compiler_output_.reserve(compiler_output_.size() + n);
-        compiler_output_.insert(compiler_output_.end(), buf.begin(),
-                                buf.begin() + n);
-        if (!ec && ap.is_open()) {
-          ap.async_read_some(output_buffer,
-                             std::bind(lambda_ref, std::placeholders::_1,
-                                       std::placeholders::_2, lambda_ref));
-        }
-      };
-      return lambda_impl(ec, size, lambda_impl);
-    };
-    ap.async_read_some(output_buffer, OnStdout);
-    ios.run();
-    c.join();
+        compiler_output_ += "rcrl: loading cached " + cached.string() + "\n";
+        compiled_artifact_ = cached;
+        compiled_artifact_cached_ = true;
+        timings_.compile = ElapsedSince(start);
+        timings_.cached = true;
+        is_compiling_ = false;
+        return 0;
+      }
+    }
+    if (backend_ != Backend::kJit) {
+      compiled_artifact_ = NewPluginOutput();
+    }
+    auto exit_code = CompileGeneratedSource(*job);
+    if (exit_code != 0 && !job->IsCancelled() && PchOutOfDate()) {
+      // a header the prelude includes changed while the session was open
+      prelude_pch_key_.clear();
+      UpdatePrecompiledPrelude(*job);
+      UpdatePrecompiledHeaders(*job);
+      {
+        std::lock_guard<std::mutex> lock(compiler_output_mut_);
+        compiler_output_ = "rcrl: the prelude changed, rebuilt its pch\n";
+      }
+      exit_code = CompileGeneratedSource(*job);
+    }
+    CollectDiagnostics();
+    if (exit_code == 0 && !artifact_key.empty()) {
+      cache_->Store(artifact_key, compiled_artifact_);
+    }
+    if (exit_code == 0 && time_trace_ && backend_ == Backend::kProcess) {
+      time_trace_->Add(GetTimeTraceFile(), code);
+    }
+    timings_.compile = ElapsedSince(start) - timings_.link;
     is_compiling_ = false;
-    return c.exit_code();
-  });
+    return exit_code;
+  };
+  compiler_process_ =
+      scheduler_ ? scheduler_->Submit(session_dir_.string(), task)
+                 : std::async(std::launch::async, task);
+  return true;
+}
+
+SnippetParts Plugin::ParseSnippet(const string& code, const string& context) {
+  assert(!IsCompiling() && !compiler_process_.valid());
+  // the speculation owns the parser
+  CancelSpeculation();
+  // line endings fixed as CompileCode does
+  auto source = context;
+  replace(source.begin(), source.end(), '\r', '\n');
+  if (!source.empty() && source.back() != '\n') {
+    source += '\n';
+  }
+  // after the include GetParsedSource adds
+  const auto first_line =
+      2 + static_cast<unsigned int>(
+              std::count(source.begin(), source.end(), '\n'));
+  source += code;
+  replace(source.begin(), source.end(), '\r', '\n');
+  parser_.Reparse(GetParsedSource(source));
+  SnippetParts parts;
+  parts.globals = parser_.HasGlobalCode(first_line);
+  parts.statements = parser_.HasOnceCode(first_line);
+  return parts;
+}
+
+string Plugin::GetParsedSource(const string& code) {
+  // add header to correctly parse the input
+  auto header = parser_.get_file().stem().string() + ".hpp";
+  return "#include \"" + header + "\"\n" + code;
+}
+
+string Plugin::GenerateSource() {
+  if (!phase_timing_ || backend_ == Backend::kJit) {
+    parser_.GenerateSourceFile("");
+    return "";
+  }
+  // the first initializer of the plugin takes the time and the last one
+  // exports how long the ones in between took, numbered like the once block
+  // so that it doesn't clash with the probes of the loaded plugins
+  const auto probe = "__rcrl_internal_init_ns_" +
+                     std::to_string(parser_.get_code_gen_number());
+  parser_.GenerateSourceFile(
+      "",
+      "#include <ctime>\n"
+      "static long long __rcrl_internal_clock() {\n"
+      "  std::timespec t;\n"
+      "  std::timespec_get(&t, TIME_UTC);\n"
+      "  return t.tv_sec * 1000000000ll + t.tv_nsec;\n"
+      "}\n"
+      "static long long __rcrl_internal_init_start = "
+      "__rcrl_internal_clock();\n",
+      "extern \"C\" {\n" __STR(RCRL_EXPORT_API) " long long " + probe +
+          " = __rcrl_internal_clock() - __rcrl_internal_init_start;\n}\n");
+  return probe;
+}
+
+string Plugin::GetCompilerInput(const string& source,
+                                const fs::path& file_name) {
+  // diagnostics refer to file_name as if the source was read from it
+  return "#line 1 \"" + file_name.generic_string() + "\"\n" + source;
+}
+
+string Plugin::GetCompileCommand(const fs::path& output_file,
+                                 const fs::path& diagnostics_file,
+                                 const std::vector<string>& extra_flags) {
+  // must use clang++ as g++ differ from libclang deduced types
+  auto cmd = bp::search_path("clang++").string() + string(" ");
+  for (const auto& flag : GetCompileFlags()) {
+    cmd += flag + string(" ");
+  }
+  const auto pch = GetPchFile();
+  if (!pch.empty()) {
+    cmd += "-include-pch " + pch.string() + " ";
+  }
+  if (!diagnostics_file.empty()) {
+    cmd += "--serialize-diagnostics " + diagnostics_file.string() + " ";
+  }
+  for (const auto& flag : extra_flags) {
+    cmd += flag + string(" ");
+  }
+  // the source comes through stdin, the headers are next to the file
+  cmd += "-shared -Wl,-undefined,error -Wl,-flat_namespace -iquote " +
+         session_dir_.string() + " -x c++ - -o " + output_file.string();
+  return cmd;
+}
+
+int Plugin::CompileGeneratedSource(CompileJob& job) {
+  if (backend_ == Backend::kJit) {
+    return CompileInProcess();
+  }
+  if (backend_ == Backend::kServer) {
+    return CompileOnServer(job);
+  }
+  const auto input =
+      GetCompilerInput(parser_.get_generated_source(), parser_.get_file());
+  std::vector<string> extra_flags;
+  std::error_code ec;
+  // clang++ appends to it
+  const auto stat_file =
+      session_dir_ / (parser_.get_file().stem().string() + ".stat");
+  if (phase_timing_) {
+    fs::remove(stat_file, ec);
+    extra_flags.push_back("-fproc-stat-report=" + stat_file.string());
+  }
+  if (time_trace_) {
+    fs::remove(GetTimeTraceFile(), ec);
+    extra_flags.push_back("-ftime-trace=" + GetTimeTraceFile().string());
+    // in microseconds, the default of 500 hides most headers
+    extra_flags.push_back("-ftime-trace-granularity=50");
+  }
+  const auto exit_code = RunCompiler(
+      GetCompileCommand(compiled_artifact_, GetDiagnosticsFile(), extra_flags),
+      job, nullptr, &input);
+  if (!phase_timing_) {
+    return exit_code;
+  }
+  timings_.link = ReadLinkTime(stat_file);
+  fs::remove(stat_file, ec);
+  // the linker runs last
+  AddTraceEvent("link", std::chrono::steady_clock::now() - timings_.link,
+                timings_.link);
+  return exit_code;
+}
+
+fs::path Plugin::GetTimeTraceFile() {
+  return session_dir_ /
+         (parser_.get_file().stem().string() + "_time_trace.json");
+}
+
+bool Plugin::RejectedByPreflight() {
+  auto errors = parser_.GetHardErrors();
+  if (errors.empty()) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(compiler_output_mut_);
+  for (const auto& d : errors) {
+    compiler_output_ += "code:" + std::to_string(d.code_line) + ":" +
+                        std::to_string(d.column) + ": " +
+                        (d.severity == Severity::kFatal ? "fatal error: "
+                                                        : "error: ") +
+                        d.message + "\n";
+  }
+  compiler_output_ += "rcrl: not compiled, fix the errors above first\n";
+  diagnostics_.insert(diagnostics_.end(), errors.begin(), errors.end());
+  return true;
+}
+
+void Plugin::set_preflight(bool enabled) { preflight_ = enabled; }
+
+fs::path Plugin::GetDiagnosticsFile() {
+  return session_dir_ / (parser_.get_file().stem().string() + ".dia");
+}
+
+void Plugin::CollectDiagnostics() {
+  const auto file = GetDiagnosticsFile();
+  if (!fs::exists(file)) {
+    return;
+  }
+  string error;
+  auto diagnostics = LoadSerializedDiagnostics(file, error);
+  // never read twice, a compile that is cancelled early doesn't write it
+  fs::remove(file);
+  for (auto& d : diagnostics) {
+    if (fs::path(d.file).lexically_normal() ==
+        parser_.get_file().lexically_normal()) {
+      // the first line of the parsed file includes the accumulated header
+      auto line = parser_.GetSourceLine(d.line);
+      d.code_line = line > 1 ? line - 1 : 0;
+    }
+  }
+  std::lock_guard<std::mutex> lock(compiler_output_mut_);
+  if (!error.empty()) {
+    compiler_output_ += "rcrl: " + error + "\n";
+  }
+  diagnostics_.insert(diagnostics_.end(), diagnostics.begin(),
+                      diagnostics.end());
+}
+
+std::vector<Diagnostic> Plugin::get_new_diagnostics() {
+  std::lock_guard<std::mutex> lock(compiler_output_mut_);
+  std::vector<Diagnostic> out;
+  out.swap(diagnostics_);
+  return out;
+}
+
+bool Plugin::CompileSpeculatively(string code) {
+  // the result of a finished compile isn't consumed yet while the future is
+  // valid, TryGetExitStatusFromCompile still needs the parser as it is
+  // the arena would reserve slots for variables that may never be loaded
+  if (!cache_ || backend_ != Backend::kProcess || arena_ || IsCompiling() ||
+      compiler_process_.valid() || code.empty()) {
+    return false;
+  }
+  replace(code.begin(), code.end(), '\r', '\n');
+  if (code == speculative_code_) {
+    return true;
+  }
+  CancelSpeculation(false);
+  speculative_code_ = code;
+  speculative_job_ = std::make_shared<CompileJob>(limits_);
+  // the cancelled job still has to exit before the parser can be reused
+  auto previous = std::move(speculation_);
+  speculation_ = std::async(
+      std::launch::async, [this, code, job = speculative_job_,
+                           previous = std::move(previous)]() mutable {
+        TraceScope trace("CompileSpeculatively");
+        if (previous.valid()) {
+          previous.wait();
+        }
+        auto IsStale = [&]() { return job->IsCancelled(); };
+        if (IsStale()) {
+          return;
+        }
+        parser_.Reparse(GetParsedSource(code));
+        if (preflight_ && !parser_.GetHardErrors().empty()) {
+          return;
+        }
+        // the real compile must generate the same symbols to hit the cache
+        auto code_gen_number = parser_.get_code_gen_number();
+        GenerateSource();
+        parser_.set_code_gen_number(code_gen_number);
+        if (IsStale()) {
+          return;
+        }
+        UpdatePrecompiledPrelude(*job);
+        UpdatePrecompiledHeaders(*job);
+        auto key = GetArtifactKey();
+        if (IsStale() || cache_->Contains(key)) {
+          return;
+        }
+        const auto artifact =
+            session_dir_ / (parser_.get_file().stem().string() +
+                              "_speculative" + RCRL_EXTENSION);
+        // errors are reported by the real compile, not while typing
+        string output;
+        const auto input = GetCompilerInput(parser_.get_generated_source(),
+                                            parser_.get_file());
+        if (RunCompiler(GetCompileCommand(artifact), *job, &output, &input) ==
+                0 &&
+            !IsStale()) {
+          cache_->Store(key, artifact);
+        }
+      });
   return true;
 }
 
+void Plugin::CancelSpeculation(bool wait) {
+  if (speculative_job_) {
+    speculative_job_->Cancel();
+  }
+  speculative_code_.clear();
+  if (wait && speculation_.valid()) {
+    speculation_.wait();
+  }
+}
+
+void Plugin::set_compile_limits(CompileLimits limits) { limits_ = limits; }
+
+void Plugin::set_scheduler(std::shared_ptr<CompileScheduler> scheduler) {
+  assert(!IsCompiling());
+  scheduler_ = std::move(scheduler);
+}
+
+void Plugin::set_parse_service(std::shared_ptr<ParseService> service) {
+  assert(!IsCompiling());
+  CancelSpeculation();
+  if (flags_process_.valid()) {
+    flags_process_.wait();
+  }
+  // the parser drops the units of the old service before it may go away
+  parser_.set_service(service.get());
+  parse_service_ = std::move(service);
+}
+
+fs::path Plugin::get_session_dir() { return session_dir_; }
+
+void Plugin::CancelCompile() {
+  if (job_) {
+    job_->Cancel();
+  }
+  CancelSpeculation(false);
+}
+
+fs::path Plugin::NewPluginOutput() {
+  // the previous output was never loaded
+  if (output_fd_ >= 0) {
+    close(output_fd_);
+    output_fd_ = -1;
+  }
+#ifdef __linux__
+  if (use_memfd_ && CanLinkIntoMemfd()) {
+    output_fd_ = memfd_create(RCRL_PLUGIN_NAME, MFD_CLOEXEC);
+    if (output_fd_ >= 0) {
+      // written by the compiler process, so not /proc/self
+      return "/proc/" + std::to_string(getpid()) + "/fd/" +
+             std::to_string(output_fd_);
+    }
+    use_memfd_ = false;
+  }
+#endif
+  return session_dir_ / (std::string(RCRL_PLUGIN_NAME) + "_" +
+                         std::to_string(plugins_.size()) + RCRL_EXTENSION);
+}
+
+void Plugin::set_artifact_cache(fs::path dir, uintmax_t max_bytes) {
+  assert(!IsCompiling());
+  CancelSpeculation();
+  cache_ = std::make_unique<ArtifactCache>(std::move(dir), max_bytes);
+}
+
+CacheStats Plugin::get_cache_stats() {
+  return cache_ ? cache_->get_stats() : CacheStats();
+}
+
+string Plugin::GetArtifactKey() {
+  if (compiler_version_.empty()) {
+    bp::ipstream version_stream;
+    bp::child c(bp::search_path("clang++").string() + " --version",
+                bp::std_out > version_stream, bp::std_err > bp::null);
+    std::getline(version_stream, compiler_version_);
+    c.wait();
+    // the plugins use the types and functions of the host, a rebuilt host
+    // may have changed their layout
+    std::error_code ec;
+    const fs::path host = "/proc/self/exe";
+    const auto built = fs::last_write_time(host, ec).time_since_epoch();
+    host_identity_ = fs::read_symlink(host, ec).string() + " " +
+                     std::to_string(fs::file_size(host, ec)) + " " +
+                     std::to_string(built.count());
+  }
+  Hasher hasher;
+  hasher.Update(compiler_version_);
+  hasher.Update(host_identity_);
+  hasher.Update(std::to_string(static_cast<int>(backend_)));
+  for (const auto& flag : GetCompileFlags()) {
+    hasher.Update(flag);
+  }
+  for (const auto& header : prelude_) {
+    hasher.Update(header);
+  }
+  // their contents, the headers they include change with the host
+  for (const auto& file : FindPreludeHeaders()) {
+    std::ifstream header(file);
+    hasher.Update(string(std::istreambuf_iterator<char>(header), {}));
+  }
+  // plugin.hpp itself only names the last header of the chain
+  for (const auto& file : header_chain_) {
+    std::ifstream header(file);
+    hasher.Update(string(std::istreambuf_iterator<char>(header), {}));
+  }
+  hasher.Update(parser_.get_generated_source());
+  return hasher.Digest();
+}
+
 bool Plugin::IsCompiling() { return is_compiling_; }
 
 bool Plugin::TryGetExitStatusFromCompile(int& exit_code) {
@@ -199,14 +1094,22 @@ bool Plugin::TryGetExitStatusFromCompile(int& exit_code) {
                             std::to_string(exit_code) + ", aka " +
                             strsignal(exit_code) + "\n");
     if (last_compile_successful_) {
-      auto header = parser_.get_file().replace_extension(".hpp");
-      parser_.GenerateHeaderFile(header);
+      AppendHeaderFile();
+      if (backend_ != Backend::kJit) {
+        string error;
+        parser_.GenerateCompactionSource(compaction_definitions_,
+                                         compaction_variables_, error);
+        if (compaction_error_.empty()) {
+          compaction_error_ = error;
+        }
+      }
     }
     return true;
   }
   return false;
 }
 string Plugin::CopyAndLoadNewPlugin(bool redirect_stdout) {
+  TraceScope trace("CopyAndLoadNewPlugin");
   assert(!IsCompiling());
   assert(last_compile_successful_);
   is_compiling_ = true;
@@ -214,57 +1117,266 @@ string Plugin::CopyAndLoadNewPlugin(bool redirect_stdout) {
       false;  // shouldn't call this function twice in a
               // row without compiling anything in between
 
-  // copy the plugin
-  const auto name_copied =
-      kRcrlOutputDir / (std::string(RCRL_PLUGIN_NAME) + "_" +
-                        std::to_string(plugins_.size()) + RCRL_EXTENSION);
-  std::error_code copy_res;
-  fs::copy(kRcrlOutputDir / (std::string(RCRL_PLUGIN_NAME) + RCRL_EXTENSION),
-           name_copied, fs::copy_options::overwrite_existing, copy_res);
-  assert(copy_res.value() == 0);
-  int fd;
-  fpos_t pos;
-
-  if (redirect_stdout) {
-    // Save position of current standard output
-    fgetpos(stdout, &pos);
-    fd = dup(fileno(stdout));
-    freopen(kRcrlOutputFile.c_str(), "w", stdout);
-  }
-  // load the plugin
-  auto plugin = RDRL_LoadDynlib(name_copied.c_str());
-  if (!plugin) {
-    fprintf(stderr, "%s\n", dlerror());
-    exit(EXIT_FAILURE);
-  }
-  assert(plugin);
-
-  // add the plugin to the list of loaded ones - for later unloading
-  plugins_.push_back({name_copied, plugin});
+  // cache entries are shared and dlopen would hand back an already loaded
+  // entry without running its initializers, so load a private copy
+  if (backend_ != Backend::kJit && compiled_artifact_cached_) {
+    TraceScope trace("fs::copy_file");
+    auto copy = NewPluginOutput();
+    std::error_code copy_res;
+    fs::copy_file(compiled_artifact_, copy,
+                  fs::copy_options::overwrite_existing, copy_res);
+    assert(copy_res.value() == 0);
+    compiled_artifact_ = copy;
+    compiled_artifact_cached_ = false;
+  }
+  auto out = RunWithStdoutCapture(redirect_stdout, [&]() {
+    const auto start = std::chrono::steady_clock::now();
+    if (backend_ == Backend::kJit) {
+      TraceScope trace("LoadLastCompiled");
+      string error;
+      if (!jit_->LoadLastCompiled(error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+      }
+      timings_.load = ElapsedSince(start);
+      return;
+    }
+    // load the plugin
+    RCRL_Dynlib plugin = nullptr;
+    {
+      TraceScope trace("dlopen");
+      plugin = RDRL_LoadDynlib(compiled_artifact_.c_str());
+    }
+    if (!plugin) {
+      fprintf(stderr, "%s\n", dlerror());
+      exit(EXIT_FAILURE);
+    }
+    assert(plugin);
+    timings_.load = ElapsedSince(start);
+    if (!init_probe_.empty()) {
+      if (auto ns = static_cast<long long*>(
+              dlsym(plugin, init_probe_.c_str()))) {
+        timings_.static_init = std::chrono::microseconds(*ns / 1000);
+        timings_.load -= std::min(timings_.load, timings_.static_init);
+        // the initializers run at the end of dlopen
+        AddTraceEvent("static init", start + timings_.load,
+                      timings_.static_init);
+      }
+    }
+
+    // add the plugin to the list of loaded ones - for later unloading
+    plugins_.push_back({compiled_artifact_, plugin});
+    if (output_fd_ >= 0) {
+      plugin_fds_.push_back(output_fd_);
+      output_fd_ = -1;
+    }
+  });
+  is_compiling_ = false;
+  if (compaction_threshold_ && !compaction_failed_ &&
+      compaction_error_.empty() && plugins_.size() >= compaction_threshold_) {
+    out += CompactPlugins(redirect_stdout);
+  }
+  return out;
+}
 
+string Plugin::CompactPlugins(bool redirect_stdout) {
+  TraceScope trace("CompactPlugins");
+  assert(!IsCompiling());
+  CancelSpeculation();
+  last_compaction_ = CompactionReport();
+  auto& report = last_compaction_;
+  report.plugins_before = report.plugins_after = plugins_.size();
+  report.mappings_before = report.mappings_after = CountMappings();
   string out;
+  if (backend_ == Backend::kJit) {
+    report.error = "the jit backend doesn't load libraries";
+  } else if (plugins_.size() < 2) {
+    report.error = "nothing to merge";
+  } else if (!compaction_error_.empty()) {
+    report.error = compaction_error_;
+  } else {
+    CompactLoadedPlugins(redirect_stdout, out);
+  }
+  std::lock_guard<std::mutex> lock(compiler_output_mut_);
+  if (report.compacted) {
+    compiler_output_ +=
+        "rcrl: compacted " + std::to_string(report.plugins_before) +
+        " plugins, " + std::to_string(report.mappings_before) + " -> " +
+        std::to_string(report.mappings_after) + " mappings, compiled in " +
+        std::to_string(report.compile_time.count()) + " ms, loaded in " +
+        std::to_string(report.load_time.count()) + " us\n";
+  } else {
+    compiler_output_ += "rcrl: plugins not compacted, " + report.error + "\n";
+  }
+  return out;
+}
+
+void Plugin::CompactLoadedPlugins(bool redirect_stdout, string& out) {
+  auto& report = last_compaction_;
+  // the merged library moves each variable out of the address it has now,
+  // which is known before the old libraries are unloaded
+  std::ostringstream source;
+  source << "#include \"" << prelude_file_.filename().string() << "\"\n"
+         << "#include <cstdint>\n#include <cstring>\n#include <utility>\n"
+         << "static void* __rcrl_relocation_source(const char* symbol) {\n"
+         << "  static const struct {\n"
+         << "    const char* symbol;\n"
+         << "    std::uintptr_t address;\n"
+         << "  } table[] = {\n";
+  for (const auto& symbol : compaction_variables_) {
+    void* address = nullptr;
+    // a later definition shadows the earlier ones
+    for (auto it = plugins_.rbegin(); !address && it != plugins_.rend();
+         ++it) {
+      address = dlsym(it->second, symbol.c_str());
+    }
+    if (!address) {
+      report.error = symbol + " isn't exported by the loaded plugins";
+      compaction_failed_ = true;
+      return;
+    }
+    source << "      {\"" << symbol << "\", "
+           << reinterpret_cast<std::uintptr_t>(address) << "u},\n";
+  }
+  source << "      {nullptr, 0}};\n"
+         << "  for (auto entry = table; entry->symbol; ++entry) {\n"
+         << "    if (std::strcmp(entry->symbol, symbol) == 0) {\n"
+         << "      return reinterpret_cast<void*>(entry->address);\n"
+         << "    }\n"
+         << "  }\n"
+         << "  return nullptr;\n"
+         << "}\n"
+         << "template <class T>\n"
+         << "static T __rcrl_relocate(const char* symbol) {\n"
+         << "  return std::move(\n"
+         << "      *static_cast<T*>(__rcrl_relocation_source(symbol)));\n"
+         << "}\n";
+  // only the last definition of a symbol is kept, the ones it replaces
+  // become declarations for the code in between
+  std::map<string, size_t> last_definition;
+  for (size_t i = 0; i < compaction_definitions_.size(); ++i) {
+    if (!compaction_definitions_[i].symbol.empty()) {
+      last_definition[compaction_definitions_[i].symbol] = i;
+    }
+  }
+  for (size_t i = 0; i < compaction_definitions_.size(); ++i) {
+    const auto& definition = compaction_definitions_[i];
+    source << (definition.symbol.empty() ||
+                       last_definition[definition.symbol] == i
+                   ? definition.definition
+                   : definition.declaration);
+  }
+  const auto source_file =
+      session_dir_ / (parser_.get_file().stem().string() + "_compact.cpp");
+  const auto input = GetCompilerInput(source.str(), source_file);
+  const auto artifact =
+      session_dir_ / (std::string(RCRL_PLUGIN_NAME) + "_compact_" +
+                      std::to_string(compactions_++) + RCRL_EXTENSION);
 
-  if (redirect_stdout) {
-    // Flush stdout so any buffered messages are delivered
-    fflush(stdout);
-    // Close file and restore standard output to stdout - which should be the
-    // terminal
-    dup2(fd, fileno(stdout));
+  // -Bsymbolic binds the merged library to its own definitions while the
+  // old ones are still loaded
+  auto cmd = bp::search_path("clang++").string() + string(" ");
+  for (const auto& flag : GetCompileFlags()) {
+    cmd += flag + string(" ");
+  }
+  cmd += "-shared -Wl,-Bsymbolic -Wl,-undefined,error -Wl,-flat_namespace "
+         "-iquote " +
+         session_dir_.string() + " -x c++ - -o " + artifact.string();
+  CompileJob job(limits_);
+  string output;
+  auto start = std::chrono::steady_clock::now();
+  auto exit_code = RunCompiler(cmd, job, &output, &input);
+  report.compile_time = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+  if (exit_code != 0) {
+    report.error = "the merged plugins don't compile\n" + output;
+    compaction_failed_ = true;
+    std::remove(artifact.c_str());
+    return;
+  }
+
+  void* merged = nullptr;
+  start = std::chrono::steady_clock::now();
+  out = RunWithStdoutCapture(redirect_stdout, [&]() {
+    merged = RDRL_LoadDynlib(artifact.c_str());
+    if (!merged) {
+      return;
+    }
+    // the moved from variables are destroyed with their libraries
+    for (auto it = plugins_.rbegin(); it != plugins_.rend(); ++it) {
+      RCRL_CloseDynlib(it->second);
+    }
+  });
+  report.load_time = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+  if (!merged) {
+    const char* error = dlerror();
+    report.error = error ? error : "the merged plugins don't load";
+    compaction_failed_ = true;
+    std::remove(artifact.c_str());
+    return;
+  }
+  for (const auto& [name, _] : plugins_) {
+    if (name.rfind("/proc/", 0) != 0) {
+      std::remove(name.c_str());
+    }
+  }
+  for (auto fd : plugin_fds_) {
     close(fd);
-    clearerr(stdout);
-    fsetpos(stdout, &pos);
+  }
+  plugin_fds_.clear();
+  plugins_ = {{artifact.string(), merged}};
+  report.compacted = true;
+  report.plugins_after = plugins_.size();
+  report.mappings_after = CountMappings();
+}
+
+void Plugin::set_compaction_threshold(size_t plugins) {
+  compaction_threshold_ = plugins;
+}
 
-    FILE* f = fopen(kRcrlOutputFile.c_str(), "rb");
-    fseek(f, 0, SEEK_END);
-    long fsize = ftell(f);
-    fseek(f, 0, SEEK_SET);
+CompactionReport Plugin::get_last_compaction() { return last_compaction_; }
 
-    out.resize(fsize);
-    fread((void*)out.data(), fsize, 1, f);
-    fclose(f);
+void Plugin::set_phase_timing(bool enabled) {
+  assert(!IsCompiling());
+  CancelSpeculation();
+  phase_timing_ = enabled;
+}
+
+SubmitTimings Plugin::get_last_timings() {
+  assert(!IsCompiling());
+  return timings_;
+}
+
+void Plugin::set_time_trace(bool enabled) {
+  assert(!IsCompiling());
+  CancelSpeculation();
+  if (!enabled) {
+    time_trace_.reset();
+  } else if (!time_trace_) {
+    time_trace_ = std::make_unique<TimeTraceTable>();
   }
-  is_compiling_ = false;
-  return out;
+}
+
+TimeTraceReport Plugin::get_time_trace_report(size_t top) {
+  return time_trace_ ? time_trace_->GetReport(top) : TimeTraceReport();
+}
+
+void Plugin::set_variable_arena(bool enabled) {
+  assert(!IsCompiling());
+  CleanupPlugins();
+  arena_ = enabled ? std::make_unique<VariableArena>() : nullptr;
+  parser_.set_arena(arena_.get());
+}
+
+ArenaStats Plugin::get_arena_stats() {
+  return arena_ ? arena_->get_stats() : ArenaStats();
+}
+
+void Plugin::set_trampolines(bool enabled) {
+  assert(!IsCompiling());
+  CleanupPlugins();
+  trampolines_ = enabled ? std::make_unique<TrampolineTable>() : nullptr;
+  parser_.set_trampolines(trampolines_.get());
 }
 
 }  // namespace rcrl
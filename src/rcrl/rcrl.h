@@ -2,41 +2,312 @@
 
 #include <boost/asio.hpp>
 #include <boost/process.hpp>
+#include <chrono>
 #include <filesystem>
+#include <functional>
 #include <string>
 #include <vector>
 
+#include "rcrl_arena.h"
+#include "rcrl_cache.h"
+#include "rcrl_capture.h"
+#include "rcrl_completion.h"
+#include "rcrl_diagnostics.h"
+#include "rcrl_jit.h"
+#include "rcrl_job.h"
+#include "rcrl_parse_service.h"
 #include "rcrl_parser.h"
+#include "rcrl_scheduler.h"
+#include "rcrl_server.h"
+#include "rcrl_time_trace.h"
+#include "rcrl_trace.h"
+#include "rcrl_trampoline.h"
 
 using std::string;
 namespace fs = std::filesystem;
 namespace rcrl {
 const auto kRcrlOutputDir = fs::temp_directory_path();
-const auto kRcrlOutputFile = kRcrlOutputDir.string() + "/rcrl_stdout.txt";
+// headers that are precompiled once per flag set and implicitly available
+// to every plugin, each entry is written as is after "#include "
+const std::vector<string> kRcrlDefaultPrelude = {
+    "<algorithm>", "<cstdio>", "<iostream>",
+    "<string>",    "<utility>", "<vector>"};
+
+enum class Backend {
+  kProcess,  // clang++ child process, shared object and dlopen
+  kJit,      // in process clang frontend and orc jit, see JitEngine
+  kServer    // warm rcrl_compile_server process, shared object and dlopen
+};
+
+// unique per process and call, created under kRcrlOutputDir
+fs::path NewSessionDirectory();
+
+struct CompactionReport {
+  bool compacted = false;
+  string error;  // why the plugins were left as they were
+  size_t plugins_before = 0;
+  size_t plugins_after = 0;
+  size_t mappings_before = 0;  // lines of /proc/self/maps
+  size_t mappings_after = 0;
+  std::chrono::milliseconds compile_time{0};
+  // dlopen of the merged library and dlclose of the ones it replaces
+  std::chrono::microseconds load_time{0};
+};
+
+// wall clock of the phases of the last submission. The link step and the
+// static initialization are only measured with set_phase_timing, otherwise
+// they are part of compile and load
+struct SubmitTimings {
+  std::chrono::microseconds reparse{0};  // libclang, with the preflight
+  std::chrono::microseconds codegen{0};
+  // the pchs and the compiler, or the lookup of a cached plugin
+  std::chrono::microseconds compile{0};
+  std::chrono::microseconds link{0};  // the linker clang++ ran
+  std::chrono::microseconds load{0};  // dlopen or the jit
+  // of the globals and statements of the plugin, while it was loaded
+  std::chrono::microseconds static_init{0};
+  bool cached = false;  // loaded from the artifact cache
+};
+
+// what a snippet has, see ParseSnippet. The statements of a plugin run after
+// every one of its globals is initialized, so a snippet with globals that
+// follows statements can't share their plugin without changing the order
+struct SnippetParts {
+  bool globals = false;  // definitions, includes and macros
+  bool statements = false;
+};
 
 class Plugin {
  public:
-  Plugin(fs::path file_base_name_path = kRcrlOutputDir / "plugin",
-         std::vector<string> flags = std::vector<string>(0));
+  // all files of the session are kept next to file_base_name_path, an empty
+  // path creates a fresh session directory that is removed with the plugin
+  Plugin(fs::path file_base_name_path = fs::path(),
+         std::vector<string> flags = std::vector<string>(0),
+         std::vector<string> prelude = kRcrlDefaultPrelude);
   string get_new_compiler_output();
+  // structured form of the compiler errors and warnings received since the
+  // last call, mapped to the lines of the submitted code
+  std::vector<Diagnostic> get_new_diagnostics();
+  // rejects code with errors libclang already found while parsing it,
+  // without running the compiler, on by default
+  void set_preflight(bool enabled);
+  // what the code run with redirect_stdout printed so far, streamed while it
+  // runs, CopyAndLoadNewPlugin and CleanupPlugins also return it
+  string get_new_program_output();
+  // bounds the buffered program output, 0 means unlimited
+  void set_program_output_limit(size_t max_bytes, Truncation policy);
   string CleanupPlugins(bool redirect_stdout = false);
   bool CompileCode(string code);
   bool IsCompiling();
+  // parses code as CompileCode would, without compiling it. context goes
+  // before it, e.g. the snippets it would share a plugin with, so that it
+  // can use their declarations. Not while a compile runs or its exit status
+  // wasn't taken
+  SnippetParts ParseSnippet(const string& code, const string& context = "");
 
   bool TryGetExitStatusFromCompile(int& exitcode);
   string CopyAndLoadNewPlugin(bool redirect_stdout = false);
+  // relinks the definitions of all loaded plugins into a single library,
+  // moves the live variables into it and unloads the old libraries. Static
+  // locals start over. The last definition of a redefined variable or
+  // function replaces the others. Plugins are kept when a variable isn't a
+  // POD type, e.g. a std::function, or holds a pointer or reference, which
+  // may point into the old libraries, or is static and not const, or when
+  // the merged code doesn't compile. Returns what destructors printed
+  string CompactPlugins(bool redirect_stdout = false);
+  // compacts from CopyAndLoadNewPlugin once that many plugins are loaded,
+  // 0 disables it, it isn't retried after a failure until CleanupPlugins
+  void set_compaction_threshold(size_t plugins);
+  CompactionReport get_last_compaction();
+  // separates the link step of clang++ and the static initialization of the
+  // plugins in SubmitTimings. The generated source gets a clock probe around
+  // the initializers. Not for the jit, link only for the process backend
+  void set_phase_timing(bool enabled);
+  SubmitTimings get_last_timings();
+  // compiles with -ftime-trace (clang 16 or later, the process backend) and
+  // sums the traces of the session: headers by parse time, templates by
+  // instantiation time and the frontend and backend time of every snippet.
+  // Cached plugins aren't compiled, so they aren't traced. Enabling starts
+  // a new table
+  void set_time_trace(bool enabled);
+  // the top entries of each ranking and the last snippets, 0 for all
+  TimeTraceReport get_time_trace_report(size_t top = 0);
+  // keeps the variables of the snippets in a host owned arena instead of the
+  // plugins, so unloading or compacting code never touches state. Only POD
+  // types without pointers, the others may point into their plugin.
+  // Switching starts a new session
+  void set_variable_arena(bool enabled);
+  ArenaStats get_arena_stats();
+  // calls the functions of the snippets through a slot of a host owned table,
+  // a later definition of the same signature repoints the slot, so code that
+  // was loaded earlier calls it too. Functions marked RCRL_DIRECT are left as
+  // they are, so are those with attributes, extern or a template head.
+  // Switching starts a new session
+  void set_trampolines(bool enabled);
+  // parses in the background unless the flags were used recently
   void set_flags(const std::vector<string>& new_flags);
+  // completions at line and column of code, both 1 based, that know the
+  // declarations of the loaded plugins. Computed in the background, a newer
+  // request supersedes one that isn't answered yet
+  void RequestCompletion(string code, unsigned int line, unsigned int column);
+  // true once the last request was answered
+  bool TryGetCompletions(std::vector<Completion>& completions);
+  // how many recently used flag sets keep their parsed translation unit
+  void set_parse_cache_size(size_t units);
+  // memory of each cached translation unit, most recently used first
+  std::vector<UnitStats> get_parse_cache_stats();
+  // the pch is rebuilt lazily on the next compile
+  void set_prelude(const std::vector<string>& headers);
+  // switching backends starts a new session, returns false when the backend
+  // isn't available in this build
+  bool set_backend(Backend backend);
+  // caches compiled plugins by the digest of the generated source, the
+  // accumulated header, the flags, the prelude headers, the compiler version
+  // and the host executable
+  void set_artifact_cache(fs::path dir, uintmax_t max_bytes);
+  CacheStats get_cache_stats();
+  // compiles code in the background into the artifact cache without loading
+  // it, so a later CompileCode of the same code only has to load the plugin.
+  // A running speculation of other code is cancelled. Returns false when not
+  // possible: no cache, a non process backend, the variable arena or a
+  // compile in progress
+  bool CompileSpeculatively(string code);
+  // stops the running speculation, optionally waiting for it to exit
+  void CancelSpeculation(bool wait = true);
+  // applies to every compile started afterwards, the timeout counts from
+  // when it leaves the queue. The libclang parse of the code runs in the
+  // host and can't be killed, the compile only stops once it returns
+  void set_compile_limits(CompileLimits limits);
+  // kills the running compile, TryGetExitStatusFromCompile reports it failed
+  void CancelCompile();
+  // compiles run on the shared workers instead of a thread of their own
+  void set_scheduler(std::shared_ptr<CompileScheduler> scheduler);
+  // parses on the workers of the service, sharing its libclang index, its
+  // memory budget and the precompiled prelude with the other sessions
+  void set_parse_service(std::shared_ptr<ParseService> service);
+  fs::path get_session_dir();
   ~Plugin();
 
  private:
+  void ResetHeaderFile();
+  // plugin.hpp, including the last header of the chain
+  void WriteHeaderFile();
+  // adds the declarations of the last compile as a new header of the chain
+  void AppendHeaderFile();
+  string RunWithStdoutCapture(bool redirect_stdout,
+                              const std::function<void()>& run);
+  std::vector<string> GetCompileFlags(bool with_linker_flags = true);
+  // the headers of the prelude found through the include paths of the
+  // flags, system headers only change with the compiler
+  std::vector<fs::path> FindPreludeHeaders();
+  // path, size and modification time of each of them
+  string GetPreludeStamp();
+  // whether the last compile failed on a pch built from headers that changed
+  bool PchOutOfDate();
+  // (re)builds the prelude pch when flags or prelude changed since last build
+  void UpdatePrecompiledPrelude(CompileJob& job);
+  // precompiles the headers of the chain that don't have a pch yet
+  void UpdatePrecompiledHeaders(CompileJob& job);
+  // the last valid pch of the chain or the prelude, empty if none
+  fs::path GetPchFile();
+  // writes header.pch, chained to base_pch unless empty
+  bool BuildPch(const fs::path& header, const fs::path& base_pch,
+                CompileJob& job);
+  // what the parser sees, the code after an include of plugin.hpp
+  string GetParsedSource(const string& code);
+  // of the parsed code, with the probe of set_phase_timing. Returns the
+  // symbol of the probe, empty without one
+  string GenerateSource();
+  // source for the stdin of clang++, reported as file_name
+  string GetCompilerInput(const string& source, const fs::path& file_name);
+  // output goes to compiler_output_ unless given, input is piped to stdin
+  int RunCompiler(const string& cmd, CompileJob& job,
+                  string* output = nullptr, const string* input = nullptr);
+  // diagnostics_file is left out when empty, extra_flags go before the
+  // input, the source is read from stdin
+  string GetCompileCommand(const fs::path& output_file,
+                           const fs::path& diagnostics_file = fs::path(),
+                           const std::vector<string>& extra_flags = {});
+  int CompileGeneratedSource(CompileJob& job);
+  // what -ftime-trace writes for the compile of the process backend
+  fs::path GetTimeTraceFile();
+  fs::path GetDiagnosticsFile();
+  // moves the diagnostics of the last compile to diagnostics_
+  void CollectDiagnostics();
+  // reports the hard errors of the last parse, true if there were any
+  bool RejectedByPreflight();
+  int CompileInProcess();
+  int CompileOnServer(CompileJob& job);
+  string GetArtifactKey();
+  // where the next plugin is written, a memfd seen through /proc or a
+  // unique file name, either way dlopen gets a path it hasn't loaded yet
+  fs::path NewPluginOutput();
+  // does the work of CompactPlugins, failures are left in last_compaction_
+  void CompactLoadedPlugins(bool redirect_stdout, string& out);
+
   // global state
+  const fs::path session_dir_;
+  const bool owns_session_dir_;
   std::vector<std::pair<string, void*>> plugins_;
   string compiler_output_;
+  std::vector<Diagnostic> diagnostics_;  // guarded by compiler_output_mut_
+  bool preflight_ = true;
   std::mutex compiler_output_mut_;
+  BoundedOutput program_output_;
+  size_t program_output_limit_ = 0;
+  Truncation program_output_truncation_ = Truncation::kKeepTail;
+  std::mutex program_output_mut_;
   bool is_compiling_;
   std::future<int> compiler_process_;
+  std::future<bool> flags_process_;
+  std::shared_ptr<CompileScheduler> scheduler_;
+  std::shared_ptr<ParseService> parse_service_;  // outlives parser_
   bool last_compile_successful_ = false;
   PluginParser parser_;
+  std::vector<string> prelude_;
+  fs::path prelude_file_;
+  string prelude_pch_key_;
+  bool prelude_pch_valid_ = false;
+  // declarations of each successful compile, one header per compile
+  std::vector<fs::path> header_chain_;
+  size_t header_pch_count_ = 0;  // leading headers of the chain with a pch
+  bool header_pch_failed_ = false;
+  Backend backend_ = Backend::kProcess;
+  std::unique_ptr<JitEngine> jit_;
+  std::unique_ptr<CompileServer> server_;
+  std::unique_ptr<ArtifactCache> cache_;
+  std::unique_ptr<VariableArena> arena_;
+  std::unique_ptr<TrampolineTable> trampolines_;
+  std::unique_ptr<CompletionEngine> completion_;
+  // what CopyAndLoadNewPlugin loads, either fresh or from the cache
+  fs::path compiled_artifact_;
+  bool compiled_artifact_cached_ = false;
+  int output_fd_ = -1;  // memfd behind compiled_artifact_
+  bool use_memfd_ = true;
+  // memfds of the loaded plugins, open until cleanup so their /proc paths
+  // stay unique for dlopen
+  std::vector<int> plugin_fds_;
+  string compiler_version_;
+  string host_identity_;  // path, size and mtime of the executable
+  // definitions of every successful compile, see GenerateCompactionSource
+  std::vector<CompactionDefinition> compaction_definitions_;
+  std::vector<string> compaction_variables_;
+  // why the loaded plugins can't be merged, empty if they can
+  string compaction_error_;
+  size_t compaction_threshold_ = 0;
+  bool compaction_failed_ = false;
+  unsigned int compactions_ = 0;
+  CompactionReport last_compaction_;
+  bool phase_timing_ = false;
+  string init_probe_;  // symbol of the probe in the compiled plugin
+  SubmitTimings timings_;
+  std::unique_ptr<TimeTraceTable> time_trace_;  // null when not tracing
+  CompileLimits limits_;
+  std::shared_ptr<CompileJob> job_;
+  // speculative compile, stale once its job is cancelled
+  std::future<void> speculation_;
+  std::shared_ptr<CompileJob> speculative_job_;
+  string speculative_code_;
 };
 
 }  // namespace rcrl
@@ -0,0 +1,84 @@
+#include "rcrl_arena.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace rcrl {
+
+namespace {
+// committing in bigger steps saves a syscall per variable
+constexpr size_t kCommitStep = 64 << 10;
+
+size_t AlignUp(size_t value, size_t align) {
+  return (value + align - 1) / align * align;
+}
+}  // namespace
+
+VariableArena::VariableArena(size_t reserved_bytes)
+    : reserved_(AlignUp(reserved_bytes, sysconf(_SC_PAGESIZE))) {
+  auto base = mmap(nullptr, reserved_, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base != MAP_FAILED) {
+    base_ = static_cast<char*>(base);
+  }
+}
+
+VariableArena::~VariableArena() {
+  if (base_) {
+    munmap(base_, reserved_);
+  }
+}
+
+void* VariableArena::Allocate(const string& key, size_t size, size_t align) {
+  std::lock_guard<std::mutex> lock(mut_);
+  auto it = slots_.find(key);
+  if (it != slots_.end()) {
+    return it->second;
+  }
+  if (!base_) {
+    return nullptr;
+  }
+  auto offset = AlignUp(used_, std::max(align, size_t(1)));
+  auto end = offset + std::max(size, size_t(1));
+  if (end > reserved_) {
+    return nullptr;
+  }
+  if (end > committed_) {
+    auto committed = std::min(AlignUp(end, kCommitStep), reserved_);
+    if (mprotect(base_ + committed_, committed - committed_,
+                 PROT_READ | PROT_WRITE) != 0) {
+      return nullptr;
+    }
+    committed_ = committed;
+  }
+  used_ = end;
+  void* slot = base_ + offset;
+  slots_[key] = slot;
+  return slot;
+}
+
+void VariableArena::Reset() {
+  std::lock_guard<std::mutex> lock(mut_);
+  // fresh zeroed pages for the next session, same addresses
+  if (committed_) {
+    mmap(base_, committed_, PROT_NONE,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+  }
+  committed_ = 0;
+  used_ = 0;
+  slots_.clear();
+}
+
+ArenaStats VariableArena::get_stats() {
+  std::lock_guard<std::mutex> lock(mut_);
+  ArenaStats stats;
+  stats.variables = slots_.size();
+  stats.used_bytes = used_;
+  stats.committed_bytes = committed_;
+  stats.reserved_bytes = base_ ? reserved_ : 0;
+  return stats;
+}
+
+}  // namespace rcrl
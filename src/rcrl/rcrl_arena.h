@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace rcrl {
+using std::string;
+
+struct ArenaStats {
+  size_t variables = 0;
+  size_t used_bytes = 0;  // slots and alignment padding
+  size_t committed_bytes = 0;
+  size_t reserved_bytes = 0;
+};
+
+// Contiguous home of the variables defined by the snippets, so their state
+// doesn't live in the plugin that defined them. The address space is
+// reserved up front and committed as the arena grows, slots never move and
+// start zeroed. Only trivially destructible objects go in a slot, so they
+// are dropped without running code of the plugins.
+class VariableArena {
+ public:
+  explicit VariableArena(size_t reserved_bytes = size_t(1) << 30);
+  ~VariableArena();
+  // slot of key, allocated on first use, nullptr when the arena is full
+  void* Allocate(const string& key, size_t size, size_t align);
+  // frees every slot
+  void Reset();
+  ArenaStats get_stats();
+
+ private:
+  char* base_ = nullptr;
+  const size_t reserved_;
+  size_t committed_ = 0;
+  size_t used_ = 0;
+  std::map<string, void*> slots_;
+  std::mutex mut_;
+};
+
+}  // namespace rcrl
@@ -0,0 +1,156 @@
+// rcrl_batch - runs a script of snippets without the gui, e.g. on build
+// agents. Snippets are separated by lines holding only the delimiter and
+// read from the script, or stdin without one. Consecutive snippets share a
+// plugin, and so a compile, unless one with globals follows one with
+// statements, see rcrl::SnippetParts. When a shared compile fails its
+// snippets are compiled one at a time, so the errors are reported for the
+// snippet that has them and the ones before it still run.
+//
+// usage: rcrl_batch [--delimiter <line>] [--no-coalesce] [<script> | -]
+//                   [-- <compiler flags>]
+//
+// What the snippets print goes to stdout while they run, compiler errors
+// and a summary go to stderr. Stops at the first snippet that fails to
+// compile and exits with 1.
+
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rcrl.h"
+
+namespace {
+
+struct Snippet {
+  std::string code;
+  size_t line = 0;  // of the script where it starts, 1 based
+};
+
+std::vector<Snippet> Split(std::istream& script, const std::string& delimiter) {
+  std::vector<Snippet> snippets(1, Snippet{"", 1});
+  std::string line;
+  for (size_t number = 1; std::getline(script, line); ++number) {
+    // trailing blanks and the \r of windows line endings don't count
+    auto end = line.size();
+    while (end && std::isspace(static_cast<unsigned char>(line[end - 1]))) {
+      --end;
+    }
+    if (line.compare(0, end, delimiter) == 0) {
+      snippets.push_back({"", number + 1});
+    } else {
+      snippets.back().code += line + "\n";
+    }
+  }
+  // nothing to compile in blank ones
+  std::vector<Snippet> out;
+  for (auto& snippet : snippets) {
+    if (snippet.code.find_first_not_of(" \t\r\n") != std::string::npos) {
+      out.push_back(std::move(snippet));
+    }
+  }
+  return out;
+}
+
+// compiles and loads code, errors gets the compiler output on failure
+bool Run(rcrl::Plugin& plugin, const std::string& code, std::string& errors,
+         size_t& compiles) {
+  int exitcode = 1;
+  compiles++;
+  if (plugin.CompileCode(code)) {
+    while (!plugin.TryGetExitStatusFromCompile(exitcode)) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+  errors = plugin.get_new_compiler_output();
+  if (exitcode) {
+    return false;
+  }
+  // not redirected, the snippets print straight to stdout
+  plugin.CopyAndLoadNewPlugin();
+  std::cout.flush();
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::string delimiter = "//---";
+  bool coalesce = true;
+  std::string script_file = "-";
+  std::vector<std::string> flags = {"-std=c++17"};
+  for (int i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "--delimiter") && i + 1 < argc) {
+      delimiter = argv[++i];
+    } else if (!std::strcmp(argv[i], "--no-coalesce")) {
+      coalesce = false;
+    } else if (!std::strcmp(argv[i], "--")) {
+      flags.assign(argv + i + 1, argv + argc);
+      break;
+    } else if (argv[i][0] == '-' && argv[i][1]) {
+      std::cerr << "usage: rcrl_batch [--delimiter <line>] [--no-coalesce] "
+                   "[<script> | -] [-- <compiler flags>]\n";
+      return 2;
+    } else {
+      script_file = argv[i];
+    }
+  }
+  std::ifstream file;
+  if (script_file != "-") {
+    file.open(script_file);
+    if (!file) {
+      std::cerr << "rcrl: can't read " << script_file << "\n";
+      return 2;
+    }
+  }
+  const auto snippets = Split(file.is_open() ? file : std::cin, delimiter);
+
+  rcrl::Plugin plugin(fs::path(), flags);
+  size_t compiles = 0;
+  size_t failed = snippets.size();  // the first snippet that didn't compile
+  std::string errors;
+  for (size_t i = 0; i < snippets.size() && failed == snippets.size();) {
+    auto batch = snippets[i].code;
+    auto end = i + 1;
+    if (coalesce) {
+      bool statements = plugin.ParseSnippet(batch).statements;
+      for (; end < snippets.size(); ++end) {
+        const auto parts = plugin.ParseSnippet(snippets[end].code, batch);
+        if (statements && parts.globals) {
+          break;
+        }
+        statements |= parts.statements;
+        batch += snippets[end].code;
+      }
+    }
+    if (!Run(plugin, batch, errors, compiles)) {
+      failed = i;
+      // a failed compile loaded nothing, one at a time tells which failed
+      if (end - i > 1) {
+        failed = snippets.size();
+        for (auto k = i; k < end; ++k) {
+          if (!Run(plugin, snippets[k].code, errors, compiles)) {
+            failed = k;
+            break;
+          }
+        }
+      }
+    }
+    i = end;
+  }
+  if (failed < snippets.size()) {
+    std::cerr << "rcrl: snippet " << failed + 1 << " at line "
+              << snippets[failed].line << " failed to compile\n"
+              << errors;
+  }
+  std::cerr << "rcrl: " << snippets.size() << " snippets in " << compiles
+            << " compiles\n";
+  plugin.CleanupPlugins();
+  std::cout.flush();
+  return failed < snippets.size() ? 1 : 0;
+}
@@ -0,0 +1,145 @@
+#include "rcrl_cache.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace rcrl {
+
+namespace {
+
+// one FNV-1a-128 step, the prime 2^88 + 0x13b is multiplied in 64 bit lanes
+void Step(uint64_t& hi, uint64_t& lo, unsigned char c) {
+  constexpr uint64_t kPrimeLow = 0x13b;
+  lo ^= c;
+  const uint64_t low = (lo & 0xffffffff) * kPrimeLow;
+  const uint64_t mid = (lo >> 32) * kPrimeLow + (low >> 32);
+  hi = hi * kPrimeLow + (mid >> 32) + (lo << 24);
+  lo = (mid << 32) | (low & 0xffffffff);
+}
+
+} // namespace
+
+Hasher& Hasher::Update(const string& data) {
+  for (unsigned char c : data) {
+    Step(hi_, lo_, c);
+  }
+  // the size ends every update so that consecutive updates can't be
+  // shifted into each other
+  const uint64_t size = data.size();
+  for (int i = 0; i < 8; ++i) {
+    Step(hi_, lo_, static_cast<unsigned char>(size >> (8 * i)));
+  }
+  return *this;
+}
+
+string Hasher::Digest() const {
+  static const char* kHex = "0123456789abcdef";
+  string out(32, '0');
+  for (int i = 0; i < 16; ++i) {
+    out[15 - i] = kHex[(hi_ >> (4 * i)) & 0xf];
+    out[31 - i] = kHex[(lo_ >> (4 * i)) & 0xf];
+  }
+  return out;
+}
+
+ArtifactCache::ArtifactCache(fs::path dir, uintmax_t max_bytes)
+    : dir_(std::move(dir)), max_bytes_(max_bytes) {
+  std::error_code ec;
+  fs::create_directories(dir_, ec);
+  // pick up what previous sessions left, oldest first
+  std::vector<std::pair<fs::file_time_type, fs::path>> files;
+  for (const auto& f : fs::directory_iterator(dir_, ec)) {
+    if (f.is_regular_file() && f.path().extension() == RCRL_EXTENSION) {
+      files.emplace_back(f.last_write_time(), f.path());
+    }
+  }
+  std::sort(files.begin(), files.end());
+  for (const auto& [_, path] : files) {
+    auto key = path.stem().string();
+    lru_.push_front(key);
+    entries_[key] = {lru_.begin(), fs::file_size(path, ec)};
+    stats_.bytes += entries_[key].size;
+  }
+  stats_.entries = entries_.size();
+  Evict();
+}
+
+fs::path ArtifactCache::GetPath(const string& key) {
+  return dir_ / (key + RCRL_EXTENSION);
+}
+
+fs::path ArtifactCache::Lookup(const string& key) {
+  std::lock_guard<std::mutex> lock(mut_);
+  auto it = entries_.find(key);
+  if (it != entries_.end() && !fs::exists(GetPath(key))) {
+    // removed behind our back
+    stats_.bytes -= it->second.size;
+    lru_.erase(it->second.lru_position);
+    entries_.erase(it);
+    stats_.entries = entries_.size();
+    it = entries_.end();
+  }
+  if (it == entries_.end()) {
+    stats_.misses++;
+    return {};
+  }
+  stats_.hits++;
+  lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+  std::error_code ec;
+  fs::last_write_time(GetPath(key), fs::file_time_type::clock::now(), ec);
+  return GetPath(key);
+}
+
+bool ArtifactCache::Contains(const string& key) {
+  std::lock_guard<std::mutex> lock(mut_);
+  return entries_.count(key) && fs::exists(GetPath(key));
+}
+
+void ArtifactCache::Store(const string& key, const fs::path& artifact) {
+  std::lock_guard<std::mutex> lock(mut_);
+  std::error_code ec;
+  // other processes may share the directory, they must never see a partial
+  // file so it is renamed into place
+  auto partial = GetPath(key);
+  partial += ".partial" + std::to_string(getpid());
+  fs::copy_file(artifact, partial, fs::copy_options::overwrite_existing, ec);
+  if (!ec) {
+    fs::rename(partial, GetPath(key), ec);
+  }
+  if (ec) {
+    fs::remove(partial, ec);
+    return;
+  }
+  auto it = entries_.find(key);
+  if (it != entries_.end()) {
+    stats_.bytes -= it->second.size;
+    lru_.erase(it->second.lru_position);
+  }
+  lru_.push_front(key);
+  entries_[key] = {lru_.begin(), fs::file_size(GetPath(key), ec)};
+  stats_.bytes += entries_[key].size;
+  stats_.entries = entries_.size();
+  Evict();
+}
+
+void ArtifactCache::Evict() {
+  // the most recent entry is always kept even when it alone is too big
+  while (stats_.bytes > max_bytes_ && lru_.size() > 1) {
+    const auto key = lru_.back();
+    lru_.pop_back();
+    std::error_code ec;
+    fs::remove(GetPath(key), ec);
+    stats_.bytes -= entries_[key].size;
+    entries_.erase(key);
+  }
+  stats_.entries = entries_.size();
+}
+
+CacheStats ArtifactCache::get_stats() {
+  std::lock_guard<std::mutex> lock(mut_);
+  return stats_;
+}
+
+}  // namespace rcrl
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace fs = std::filesystem;
+
+namespace rcrl {
+using std::string;
+
+struct CacheStats {
+  size_t hits = 0;
+  size_t misses = 0;
+  size_t entries = 0;
+  uintmax_t bytes = 0;
+};
+
+// FNV-1a-128 digest with the standard offset basis and prime, stable across
+// runs and platforms. Not cryptographic - there is no sha-256 among the linked
+// libraries - but a collision needs 2^64 distinct keys on average.
+class Hasher {
+ public:
+  Hasher& Update(const string& data);
+  string Digest() const;
+
+ private:
+  uint64_t hi_ = 0x6c62272e07bb0142ULL;
+  uint64_t lo_ = 0x62b821756295c58dULL;
+};
+
+// Bounded on disk store of compiled plugins keyed by a digest of everything
+// that affects the compiler output. The least recently used entries are
+// evicted, recency survives restarts through the files modification time.
+class ArtifactCache {
+ public:
+  ArtifactCache(fs::path dir, uintmax_t max_bytes);
+  // path of the cached artifact or an empty path on a miss
+  fs::path Lookup(const string& key);
+  // like Lookup but doesn't count as a use
+  bool Contains(const string& key);
+  void Store(const string& key, const fs::path& artifact);
+  CacheStats get_stats();
+
+ private:
+  struct Entry {
+    std::list<string>::iterator lru_position;
+    uintmax_t size;
+  };
+  fs::path GetPath(const string& key);
+  void Evict();
+
+  const fs::path dir_;
+  const uintmax_t max_bytes_;
+  std::mutex mut_;
+  std::list<string> lru_;  // most recently used first
+  std::unordered_map<string, Entry> entries_;
+  CacheStats stats_;
+};
+
+}  // namespace rcrl
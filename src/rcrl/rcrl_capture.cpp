@@ -0,0 +1,106 @@
+#include "rcrl_capture.h"
+
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+namespace rcrl {
+
+namespace {
+
+// a pipe holds 64 KiB, a read rarely gets more than a few lines
+constexpr size_t kReadChunk = 4096;
+
+}  // namespace
+
+void BoundedOutput::set_limit(size_t max_bytes, Truncation policy) {
+  max_bytes_ = max_bytes;
+  policy_ = policy;
+}
+
+void BoundedOutput::Append(const char* data, size_t size) {
+  if (!max_bytes_ || text_.size() + size <= max_bytes_) {
+    text_.append(data, size);
+  } else if (policy_ == Truncation::kKeepHead) {
+    const auto kept = max_bytes_ - std::min(max_bytes_, text_.size());
+    text_.append(data, kept);
+    dropped_ += size - kept;
+  } else if (size >= max_bytes_) {
+    dropped_ += text_.size() + size - max_bytes_;
+    text_.assign(data + size - max_bytes_, max_bytes_);
+  } else {
+    const auto excess = text_.size() + size - max_bytes_;
+    text_.erase(0, excess);
+    text_.append(data, size);
+    dropped_ += excess;
+  }
+}
+
+string BoundedOutput::Take() {
+  string out;
+  if (dropped_) {
+    const auto note =
+        "\n[rcrl: " + std::to_string(dropped_) + " bytes of output dropped]\n";
+    out = policy_ == Truncation::kKeepHead ? text_ + note : note + text_;
+  } else {
+    out = text_;
+  }
+  text_.clear();
+  dropped_ = 0;
+  return out;
+}
+
+StdoutCapture::StdoutCapture(
+    std::function<void(const char*, size_t)> on_output)
+    : on_output_(std::move(on_output)) {
+  int fds[2];
+  fflush(stdout);
+  if (pipe(fds) != 0) {
+    // output just stays on the real stdout
+    return;
+  }
+  saved_stdout_ = dup(fileno(stdout));
+  dup2(fds[1], fileno(stdout));
+  close(fds[1]);
+  read_end_ = fds[0];
+  reader_ = std::thread(&StdoutCapture::Read, this);
+}
+
+StdoutCapture::~StdoutCapture() {
+  if (read_end_ < 0) {
+    return;
+  }
+  fflush(stdout);
+  dup2(saved_stdout_, fileno(stdout));
+  close(saved_stdout_);
+  clearerr(stdout);
+  restored_ = true;
+  reader_.join();
+  close(read_end_);
+}
+
+void StdoutCapture::Read() {
+  std::vector<char> buf(kReadChunk);
+  pollfd pfd{read_end_, POLLIN, 0};
+  while (true) {
+    // the write end may outlive the capture in a child the snippet started,
+    // so once stdout is restored only what is already buffered is read
+    const bool restored = restored_;
+    if (poll(&pfd, 1, restored ? 0 : 50) <= 0) {
+      if (restored) {
+        return;
+      }
+      continue;
+    }
+    auto n = read(read_end_, buf.data(), buf.size());
+    if (n <= 0) {
+      return;
+    }
+    on_output_(buf.data(), n);
+  }
+}
+
+}  // namespace rcrl
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <thread>
+
+namespace rcrl {
+using std::string;
+
+enum class Truncation {
+  kKeepHead,  // drop new output while full
+  kKeepTail   // drop the oldest output
+};
+
+// Text buffer that never grows beyond its limit, a note is left where
+// output was dropped.
+class BoundedOutput {
+ public:
+  // 0 means unlimited
+  void set_limit(size_t max_bytes, Truncation policy);
+  void Append(const char* data, size_t size);
+  // returns the buffered text and clears it
+  string Take();
+
+ private:
+  string text_;
+  size_t max_bytes_ = 0;
+  Truncation policy_ = Truncation::kKeepTail;
+  size_t dropped_ = 0;
+};
+
+// Points the process stdout at a pipe for as long as it lives. A reader
+// thread hands the output to on_output in chunks while the code runs, so
+// nothing touches the disk and long running snippets show up live.
+class StdoutCapture {
+ public:
+  explicit StdoutCapture(std::function<void(const char*, size_t)> on_output);
+  // restores stdout and delivers what is left in the pipe
+  ~StdoutCapture();
+
+ private:
+  void Read();
+
+  std::function<void(const char*, size_t)> on_output_;
+  int saved_stdout_ = -1;
+  int read_end_ = -1;
+  std::atomic<bool> restored_{false};
+  std::thread reader_;
+};
+
+}  // namespace rcrl
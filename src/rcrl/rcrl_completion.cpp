@@ -0,0 +1,439 @@
+#include "rcrl_completion.h"
+
+#include <algorithm>
+#include <cctype>
+#include <set>
+#include <tuple>
+
+namespace rcrl {
+
+namespace {
+
+size_t GetOffset(const string& code, unsigned int line, unsigned int column) {
+  size_t offset = 0;
+  for (unsigned int l = 1; l < line && offset < code.size(); ++l) {
+    offset = code.find('\n', offset);
+    offset = offset == string::npos ? code.size() : offset + 1;
+  }
+  return std::min(offset + (column ? column - 1 : 0), code.size());
+}
+
+bool IsIdentifierCharacter(char c) {
+  return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+// end of the lines of directives and blanks the code starts with
+size_t GetDirectivesEnd(const string& code) {
+  size_t end = 0;
+  while (end < code.size()) {
+    const auto first = code.find_first_not_of(" \t", end);
+    if (first == string::npos || (code[first] != '#' && code[first] != '\n')) {
+      break;
+    }
+    const auto line_end = code.find('\n', first);
+    end = line_end == string::npos ? code.size() : line_end + 1;
+  }
+  return end;
+}
+
+// where the top level declaration or statement around end starts, npos when
+// end is inside of braces or parentheses. Directives end it too, so the
+// includes of the code stay out of it
+size_t GetTopLevelStart(const string& code, size_t end) {
+  size_t start = 0;
+  int depth = 0;
+  bool line_start = true;
+  for (size_t i = 0; i < end; ++i) {
+    const char c = code[i];
+    if (c == '\n') {
+      line_start = true;
+      continue;
+    }
+    if (line_start && c == '#') {
+      i = std::min(code.find('\n', i), end);
+      if (i == end) {
+        return string::npos;  // completing the directive itself
+      }
+      start = depth ? start : i + 1;
+      continue;
+    }
+    line_start = line_start && std::isspace(static_cast<unsigned char>(c));
+    if (c == '/' && i + 1 < end && code[i + 1] == '/') {
+      i = std::min(code.find('\n', i), end) - 1;
+    } else if (c == '/' && i + 1 < end && code[i + 1] == '*') {
+      i = std::min(code.find("*/", i + 2), end) + 1;
+    } else if (c == '"' || c == '\'') {
+      for (++i; i < end && code[i] != c; ++i) {
+        i += code[i] == '\\';
+      }
+    } else if (c == '{' || c == '(' || c == '[') {
+      depth++;
+    } else if (c == '}' || c == ')' || c == ']') {
+      depth = std::max(depth - 1, 0);
+      start = !depth && c == '}' ? i + 1 : start;
+    } else if (c == ';' && !depth) {
+      start = i + 1;
+    }
+  }
+  return depth ? string::npos : start;
+}
+
+bool StartsWithWord(const string& text, const string& word) {
+  return text.compare(0, word.size(), word) == 0 &&
+         (text.size() == word.size() ||
+          !IsIdentifierCharacter(text[word.size()]));
+}
+
+// the namespaces open at the end of the code and the using declarations and
+// directives in scope there, they change what the headers complete with
+string GetScopeKey(const string& code) {
+  std::vector<string> scopes(1);
+  auto start = GetDirectivesEnd(code);
+  auto statement = [&](size_t end) {
+    const auto first = code.find_first_not_of(" \t\r\n", start);
+    if (first >= end) {
+      return string();
+    }
+    auto text = code.substr(first, end - first);
+    text.erase(text.find_last_not_of(" \t\r\n") + 1);
+    return text;
+  };
+  for (size_t i = start; i < code.size(); ++i) {
+    const char c = code[i];
+    if (c == '/' && i + 1 < code.size() && code[i + 1] == '/') {
+      i = std::min(code.find('\n', i), code.size()) - 1;
+    } else if (c == '/' && i + 1 < code.size() && code[i + 1] == '*') {
+      i = std::min(code.find("*/", i + 2), code.size()) + 1;
+    } else if (c == '"' || c == '\'') {
+      for (++i; i < code.size() && code[i] != c; ++i) {
+        i += code[i] == '\\';
+      }
+    } else if (c == '{') {
+      const auto head = statement(i);
+      scopes.push_back(StartsWithWord(head, "namespace") ||
+                               StartsWithWord(head, "inline")
+                           ? head
+                           : string());
+      start = i + 1;
+    } else if (c == '}') {
+      if (scopes.size() > 1) {
+        scopes.pop_back();
+      }
+      start = i + 1;
+    } else if (c == ';') {
+      const auto text = statement(i);
+      if (StartsWithWord(text, "using")) {
+        scopes.back() += text + ";";
+      }
+      start = i + 1;
+    }
+  }
+  string key;
+  for (const auto& scope : scopes) {
+    key += scope + "{";
+  }
+  return key;
+}
+
+string GetChunkText(CXCompletionString completion_string, unsigned chunk) {
+  auto cx_text = clang_getCompletionChunkText(completion_string, chunk);
+  string text = clang_getCString(cx_text);
+  clang_disposeString(cx_text);
+  return text;
+}
+
+Completion GetCompletion(CXCompletionString completion_string) {
+  Completion completion;
+  completion.priority = clang_getCompletionPriority(completion_string);
+  string result_type;
+  for (unsigned c = 0, n = clang_getNumCompletionChunks(completion_string);
+       c < n; ++c) {
+    const auto kind = clang_getCompletionChunkKind(completion_string, c);
+    if (kind == CXCompletionChunk_Optional) {
+      continue;  // default arguments, their text is empty
+    }
+    const auto text = GetChunkText(completion_string, c);
+    if (kind == CXCompletionChunk_ResultType) {
+      result_type = text + " ";
+      continue;
+    }
+    if (kind == CXCompletionChunk_TypedText) {
+      completion.text = text;
+    }
+    completion.signature += text;
+  }
+  completion.signature = result_type + completion.signature;
+  return completion;
+}
+
+std::vector<Completion> GetCompletions(CXCodeCompleteResults* results) {
+  std::vector<Completion> completions;
+  completions.reserve(results->NumResults);
+  for (unsigned i = 0; i < results->NumResults; ++i) {
+    auto completion = GetCompletion(results->Results[i].CompletionString);
+    if (!completion.text.empty()) {
+      completions.emplace_back(std::move(completion));
+    }
+  }
+  return completions;
+}
+
+// the kind of place completed, e.g. statements or the members of std
+string GetContextKey(CXCodeCompleteResults* results) {
+  unsigned incomplete = 0;
+  auto usr = clang_codeCompleteGetContainerUSR(results);
+  auto key =
+      std::to_string(clang_codeCompleteGetContexts(results)) + " " +
+      std::to_string(clang_codeCompleteGetContainerKind(results, &incomplete)) +
+      " " + clang_getCString(usr);
+  clang_disposeString(usr);
+  return key;
+}
+
+}  // namespace
+
+CompletionEngine::CompletionEngine(fs::path file, std::vector<string> flags)
+    : file_(std::move(file)),
+      flags_(std::move(flags)),
+      index_(clang_createIndex(0, 0)),
+      worker_(&CompletionEngine::Work, this) {}
+
+CompletionEngine::~CompletionEngine() {
+  {
+    std::lock_guard<std::mutex> lock(mut_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  worker_.join();
+  if (unit_) {
+    clang_disposeTranslationUnit(unit_);
+  }
+  clang_disposeIndex(index_);
+}
+
+void CompletionEngine::Request(string code, unsigned int line,
+                               unsigned int column) {
+  {
+    std::lock_guard<std::mutex> lock(mut_);
+    pending_.assign(1, {std::move(code), line, column});
+    generation_++;
+    answered_ = false;
+  }
+  cv_.notify_all();
+}
+
+bool CompletionEngine::TryGetResults(std::vector<Completion>& results) {
+  std::lock_guard<std::mutex> lock(mut_);
+  if (!answered_) {
+    return false;
+  }
+  answered_ = false;
+  results = std::move(results_);
+  return true;
+}
+
+void CompletionEngine::Invalidate(std::vector<string> flags) {
+  {
+    std::lock_guard<std::mutex> lock(mut_);
+    flags_ = std::move(flags);
+    stale_ = true;
+  }
+  cv_.notify_all();
+}
+
+void CompletionEngine::Work() {
+  std::unique_lock<std::mutex> lock(mut_);
+  while (true) {
+    cv_.wait(lock, [&]() { return stop_ || stale_ || !pending_.empty(); });
+    if (stop_) {
+      return;
+    }
+    if (pending_.empty()) {
+      // rebuild the preamble now rather than with the next request
+      lock.unlock();
+      {
+        std::lock_guard<std::mutex> unit_lock(unit_mut_);
+        if (unit_) {
+          UpdateUnit(source_);
+        } else {
+          // the first request parses with the new flags
+          std::lock_guard<std::mutex> relock(mut_);
+          stale_ = false;
+        }
+      }
+      lock.lock();
+    } else {
+      auto request = std::move(pending_.front());
+      pending_.clear();
+      const auto generation = generation_;
+      lock.unlock();
+      // libclang can't be interrupted, a request superseded while it runs is
+      // answered but the answer is dropped
+      auto results = Complete(request.code, request.line, request.column);
+      lock.lock();
+      if (generation == generation_) {
+        results_ = std::move(results);
+        answered_ = true;
+      }
+    }
+    if (pending_.empty() && !stale_) {
+      lock.unlock();
+      Warm();
+      lock.lock();
+    }
+  }
+}
+
+void CompletionEngine::Warm() {
+  std::lock_guard<std::mutex> lock(unit_mut_);
+  if (!unit_ || warm_) {
+    return;
+  }
+  // the contexts of most completions, statements and the members of std
+  const auto statement = source_.substr(0, GetDirectivesEnd(source_)) +
+                         ";void __rcrl_complete() {";
+  CompleteSource(statement);
+  CompleteSource(statement + "std::");
+  warm_ = true;
+}
+
+void CompletionEngine::UpdateUnit(const string& source) {
+  std::vector<string> flags;
+  {
+    std::lock_guard<std::mutex> lock(mut_);
+    if (unit_ && !stale_) {
+      return;
+    }
+    flags = flags_;
+    stale_ = false;
+  }
+  // the cached results may name declarations that changed
+  cache_key_.clear();
+  cache_.clear();
+  header_completions_.clear();
+  warm_ = false;
+  CXUnsavedFile unsaved = {file_.c_str(), source.data(), source.size()};
+  if (unit_ && flags == unit_flags_) {
+    clang_reparseTranslationUnit(unit_, 1, &unsaved, CXReparse_None);
+    return;
+  }
+  if (unit_) {
+    clang_disposeTranslationUnit(unit_);
+  }
+  std::vector<const char*> args;
+  for (const auto& flag : flags) {
+    args.push_back(flag.c_str());
+  }
+  unit_ = clang_parseTranslationUnit(
+      index_, file_.c_str(), args.data(), args.size(), &unsaved, 1,
+      CXTranslationUnit_KeepGoing | CXTranslationUnit_PrecompiledPreamble |
+          CXTranslationUnit_CreatePreambleOnFirstParse |
+          CXTranslationUnit_CacheCompletionResults);
+  unit_flags_ = std::move(flags);
+}
+
+std::vector<Completion> CompletionEngine::Complete(const string& code,
+                                                   unsigned int line,
+                                                   unsigned int column) {
+  const auto cursor = GetOffset(code, line, column);
+  auto word = cursor;
+  while (word > 0 && IsIdentifierCharacter(code[word - 1])) {
+    word--;
+  }
+  // everything after the word is left out. A top level statement is moved
+  // into a function body, the way it ends up compiled, so that e.g. the
+  // members of a variable complete
+  const auto directives = GetDirectivesEnd(code);
+  const auto top_level = GetTopLevelStart(code, word);
+  string source;
+  if (word < directives) {
+    source = code.substr(0, word);
+  } else {
+    // a token right after the directives ends the preamble there, comments
+    // after them would be part of it and rebuild it with every edit
+    source = code.substr(0, directives) + ";";
+    if (top_level == string::npos || top_level < directives) {
+      source += code.substr(directives, word - directives);
+    } else {
+      source += code.substr(directives, top_level - directives) +
+                "void __rcrl_complete() {" +
+                code.substr(top_level, word - top_level);
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(unit_mut_);
+  source_ = source;
+  UpdateUnit(source_);
+  if (!unit_) {
+    return {};
+  }
+  if (source != cache_key_) {
+    cache_ = CompleteSource(source);
+    cache_key_ = source;
+  }
+  const auto typed = code.substr(word, cursor - word);
+  std::vector<Completion> completions;
+  for (const auto& completion : cache_) {
+    if (completion.text.compare(0, typed.size(), typed) == 0) {
+      completions.push_back(completion);
+      completions.back().typed = typed.size();
+    }
+  }
+  std::sort(completions.begin(), completions.end(),
+            [](const Completion& lhs, const Completion& rhs) {
+              return std::tie(lhs.priority, lhs.text) <
+                     std::tie(rhs.priority, rhs.text);
+            });
+  return completions;
+}
+
+std::vector<Completion> CompletionEngine::CompleteSource(
+    const string& source) {
+  // completing at the end of the source
+  const auto line = std::count(source.begin(), source.end(), '\n') + 1;
+  const auto line_begin = source.rfind('\n');
+  const auto column =
+      source.size() - (line_begin == string::npos ? 0 : line_begin + 1) + 1;
+  CXUnsavedFile unsaved = {file_.c_str(), source.data(), source.size()};
+  auto complete = [&](unsigned options) {
+    return clang_codeCompleteAt(unit_, file_.c_str(), line, column, &unsaved,
+                                1, options | CXCodeComplete_IncludeMacros);
+  };
+  // what the code declares is completed every time, which is quick. The
+  // declarations of the headers are by far the most and they only depend on
+  // the context and the scope, so they are completed once per both
+  auto results = complete(CXCodeComplete_SkipPreamble);
+  if (!results) {
+    return {};
+  }
+  auto completions = GetCompletions(results);
+  const auto contexts = clang_codeCompleteGetContexts(results);
+  const auto key = GetContextKey(results) + " " + GetScopeKey(source);
+  clang_disposeCodeCompleteResults(results);
+  if (contexts & (CXCompletionContext_DotMemberAccess |
+                  CXCompletionContext_ArrowMemberAccess)) {
+    return completions;  // members are found without the preamble
+  }
+  auto it = header_completions_.find(key);
+  if (it == header_completions_.end()) {
+    std::vector<Completion> from_headers;
+    results = complete(0);
+    if (results) {
+      std::set<string> from_code;
+      for (const auto& completion : completions) {
+        from_code.insert(completion.signature);
+      }
+      for (auto& completion : GetCompletions(results)) {
+        if (!from_code.count(completion.signature)) {
+          from_headers.emplace_back(std::move(completion));
+        }
+      }
+      clang_disposeCodeCompleteResults(results);
+    }
+    it = header_completions_.emplace(key, std::move(from_headers)).first;
+  }
+  completions.insert(completions.end(), it->second.begin(), it->second.end());
+  return completions;
+}
+
+}  // namespace rcrl
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <clang-c/Index.h>
+
+#include <condition_variable>
+#include <cstddef>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace rcrl {
+using std::string;
+
+struct Completion {
+  string text;       // the name to insert
+  string signature;  // for display, e.g. "int f(int x)"
+  size_t typed = 0;  // leading characters of text already before the cursor
+  unsigned priority = 0;  // lower is more likely
+};
+
+// Completes the code of a session with a translation unit of its own on a
+// thread of its own, so completing never waits for a parse or compile of the
+// session. The headers of the code are precompiled into the preamble of the
+// unit once and only rebuilt after Invalidate.
+class CompletionEngine {
+ public:
+  // file is the parsed file of the session, it has to exist so that libclang
+  // keeps a preamble, its contents are never read
+  CompletionEngine(fs::path file, std::vector<string> flags);
+  ~CompletionEngine();
+  // replaces the pending request, a superseded request is never answered.
+  // line and column are 1 based and in bytes
+  void Request(string code, unsigned int line, unsigned int column);
+  // true once the last request was answered
+  bool TryGetResults(std::vector<Completion>& results);
+  // the headers or the flags changed, the unit is rebuilt in the background
+  void Invalidate(std::vector<string> flags);
+  // what a request answers, synchronously. Results are cached for the code
+  // up to the start of the word at the cursor, so typing on only filters
+  std::vector<Completion> Complete(const string& code, unsigned int line,
+                                   unsigned int column);
+
+ private:
+  void Work();
+  // parses or reparses the unit if it is missing or stale, unit_mut_ held
+  void UpdateUnit(const string& source);
+  // completes in the common contexts once the unit changed, in advance
+  void Warm();
+  // everything completing at the end of source, unit_mut_ held
+  std::vector<Completion> CompleteSource(const string& source);
+
+  const fs::path file_;
+  std::mutex mut_;
+  std::condition_variable cv_;
+  std::vector<string> flags_;
+  bool stale_ = false;
+  struct CompletionRequest {
+    string code;
+    unsigned int line;
+    unsigned int column;
+  };
+  std::vector<CompletionRequest> pending_;  // at most one
+  unsigned int generation_ = 0;  // of the last request
+  bool answered_ = false;
+  std::vector<Completion> results_;
+  bool stop_ = false;
+
+  std::mutex unit_mut_;  // everything below
+  CXIndex index_;
+  CXTranslationUnit unit_ = nullptr;
+  std::vector<string> unit_flags_;
+  string source_;  // last completed source, kept for reparsing
+  string cache_key_;
+  std::vector<Completion> cache_;  // all results at the start of the word
+  // declarations of the headers by the context they complete in
+  std::map<string, std::vector<Completion>> header_completions_;
+  bool warm_ = false;
+
+  std::thread worker_;  // last, it uses the members above
+};
+
+}  // namespace rcrl
@@ -0,0 +1,69 @@
+#include "rcrl_diagnostics.h"
+
+namespace rcrl {
+
+namespace {
+
+string ToString(CXString str) {
+  string out = clang_getCString(str) ? clang_getCString(str) : "";
+  clang_disposeString(str);
+  return out;
+}
+
+}  // namespace
+
+void AppendDiagnostic(CXDiagnostic d, std::vector<Diagnostic>& out) {
+  Diagnostic diagnostic;
+  switch (clang_getDiagnosticSeverity(d)) {
+    case CXDiagnostic_Ignored:
+      return;
+    case CXDiagnostic_Note:
+      diagnostic.severity = Severity::kNote;
+      break;
+    case CXDiagnostic_Warning:
+      diagnostic.severity = Severity::kWarning;
+      break;
+    case CXDiagnostic_Error:
+      diagnostic.severity = Severity::kError;
+      break;
+    case CXDiagnostic_Fatal:
+      diagnostic.severity = Severity::kFatal;
+      break;
+  }
+  CXFile file;
+  clang_getSpellingLocation(clang_getDiagnosticLocation(d), &file,
+                            &diagnostic.line, &diagnostic.column, nullptr);
+  diagnostic.file = file ? ToString(clang_getFileName(file)) : "";
+  diagnostic.message = ToString(clang_getDiagnosticSpelling(d));
+  out.emplace_back(std::move(diagnostic));
+
+  // owned by d
+  auto notes = clang_getChildDiagnostics(d);
+  for (unsigned i = 0, n = clang_getNumDiagnosticsInSet(notes); i < n; ++i) {
+    auto note = clang_getDiagnosticInSet(notes, i);
+    AppendDiagnostic(note, out);
+    clang_disposeDiagnostic(note);
+  }
+}
+
+std::vector<Diagnostic> LoadSerializedDiagnostics(const fs::path& file,
+                                                  string& error) {
+  std::vector<Diagnostic> out;
+  CXLoadDiag_Error load_error;
+  CXString error_string;
+  auto set = clang_loadDiagnostics(file.c_str(), &load_error, &error_string);
+  if (!set) {
+    error = ToString(error_string);
+    return out;
+  }
+  clang_disposeString(error_string);
+  for (unsigned i = 0, n = clang_getNumDiagnosticsInSet(set); i < n; ++i) {
+    auto d = clang_getDiagnosticInSet(set, i);
+    AppendDiagnostic(d, out);
+    clang_disposeDiagnostic(d);
+  }
+  clang_disposeDiagnosticSet(set);
+  return out;
+}
+
+}  // namespace rcrl
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <clang-c/Index.h>
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace rcrl {
+using std::string;
+
+enum class Severity { kNote, kWarning, kError, kFatal };
+
+struct Diagnostic {
+  Severity severity;
+  string file;
+  unsigned int line;  // 1 based, in file
+  unsigned int column;
+  // 1 based line of the submitted code, 0 when the diagnostic isn't about it
+  unsigned int code_line = 0;
+  string message;
+};
+
+// converts d and its notes, which follow it in the output
+void AppendDiagnostic(CXDiagnostic d, std::vector<Diagnostic>& out);
+// reads the file written by clang with --serialize-diagnostics
+std::vector<Diagnostic> LoadSerializedDiagnostics(const fs::path& file,
+                                                  string& error);
+
+}  // namespace rcrl
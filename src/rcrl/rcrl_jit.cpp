@@ -0,0 +1,310 @@
+#include "rcrl_jit.h"
+
+#ifdef RCRL_WITH_JIT
+
+#include <clang/Basic/Diagnostic.h>
+#include <clang/Basic/DiagnosticOptions.h>
+#include <clang/CodeGen/CodeGenAction.h>
+#include <clang/Driver/Compilation.h>
+#include <clang/Driver/Driver.h>
+#include <clang/Driver/Job.h>
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Frontend/CompilerInvocation.h>
+#include <clang/Frontend/FrontendActions.h>
+#include <clang/Frontend/TextDiagnosticPrinter.h>
+#include <clang/Lex/PreprocessorOptions.h>
+#include <clang/Serialization/InMemoryModuleCache.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+
+namespace rcrl {
+
+struct JitEngine::Impl {
+  std::unique_ptr<llvm::orc::LLJIT> jit;
+  llvm::orc::ThreadSafeContext context{std::make_unique<llvm::LLVMContext>()};
+  llvm::orc::ThreadSafeModule pending;
+  // keeps loaded pch files in memory across compiler instances
+  llvm::IntrusiveRefCntPtr<clang::InMemoryModuleCache> module_cache{
+      new clang::InMemoryModuleCache};
+  // one dylib per plugin so redefinitions don't clash
+  std::vector<llvm::orc::JITDylib*> dylibs;
+
+  void Deinitialize() {
+    if (!jit) {
+      return;
+    }
+    // same order as dlclose-ing the plugins in reverse
+    for (auto it = dylibs.rbegin(); it != dylibs.rend(); ++it) {
+      llvm::consumeError(jit->deinitialize(**it));
+    }
+    dylibs.clear();
+  }
+};
+
+namespace {
+
+std::unique_ptr<llvm::orc::LLJIT> CreateJit(string& error) {
+  auto jit = llvm::orc::LLJITBuilder().create();
+  if (!jit) {
+    error = llvm::toString(jit.takeError());
+    return nullptr;
+  }
+  // the main dylib only serves the symbols exported by the host process
+  auto host_symbols =
+      llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+          (*jit)->getDataLayout().getGlobalPrefix());
+  if (!host_symbols) {
+    error = llvm::toString(host_symbols.takeError());
+    return nullptr;
+  }
+  (*jit)->getMainJITDylib().addGenerator(std::move(*host_symbols));
+  return std::move(*jit);
+}
+
+// let the driver translate the clang++ flags to a single cc1 invocation
+std::shared_ptr<clang::CompilerInvocation> CreateInvocation(
+    const std::vector<string>& flags, const string& file_name,
+    clang::DiagnosticsEngine& diags) {
+  std::vector<const char*> args = {RCRL_CLANG_EXECUTABLE};
+  for (const auto& flag : flags) {
+    args.push_back(flag.c_str());
+  }
+  args.push_back(file_name.c_str());
+  clang::driver::Driver driver(args[0], llvm::sys::getProcessTriple(), diags);
+  driver.setCheckInputsExist(false);
+  std::unique_ptr<clang::driver::Compilation> compilation(
+      driver.BuildCompilation(args));
+  if (!compilation || compilation->getJobs().size() != 1) {
+    return nullptr;
+  }
+  const auto& command = *compilation->getJobs().begin();
+  auto invocation = std::make_shared<clang::CompilerInvocation>();
+  if (!clang::CompilerInvocation::CreateFromArgs(
+          *invocation, command.getArguments(), diags)) {
+    return nullptr;
+  }
+  return invocation;
+}
+
+}  // namespace
+
+JitEngine::JitEngine() : impl_(new Impl) {
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+  Reset();
+}
+
+JitEngine::~JitEngine() { impl_->Deinitialize(); }
+
+bool JitEngine::IsAvailable() { return true; }
+
+int JitEngine::Compile(const string& source, const string& file_name,
+                       const std::vector<string>& flags, string& output) {
+  llvm::raw_string_ostream os(output);
+  auto diag_opts = llvm::makeIntrusiveRefCnt<clang::DiagnosticOptions>();
+  clang::TextDiagnosticPrinter printer(os, diag_opts.get());
+  clang::DiagnosticsEngine diags(
+      llvm::makeIntrusiveRefCnt<clang::DiagnosticIDs>(), diag_opts, &printer,
+      false);
+  auto args = flags;
+  args.emplace_back("-c");
+  auto invocation = CreateInvocation(args, file_name, diags);
+  if (!invocation) {
+    os << "rcrl: couldn't create a compiler invocation\n";
+    return 1;
+  }
+  // the source never touches the disk, the buffer is owned by the compiler
+  invocation->getPreprocessorOpts().addRemappedFile(
+      file_name,
+      llvm::MemoryBuffer::getMemBufferCopy(source, file_name).release());
+  clang::CompilerInstance compiler(
+      std::make_shared<clang::PCHContainerOperations>(),
+      impl_->module_cache.get());
+  compiler.setInvocation(invocation);
+  compiler.createDiagnostics(&printer, false);
+
+  impl_->pending = llvm::orc::ThreadSafeModule();
+  auto lock = impl_->context.getLock();
+  clang::EmitLLVMOnlyAction action(impl_->context.getContext());
+  if (!compiler.ExecuteAction(action)) {
+    return 1;
+  }
+  impl_->pending =
+      llvm::orc::ThreadSafeModule(action.takeModule(), impl_->context);
+  return impl_->pending ? 0 : 1;
+}
+
+int JitEngine::BuildPch(const string& header, const string& pch,
+                        const std::vector<string>& flags, string& output) {
+  llvm::raw_string_ostream os(output);
+  auto diag_opts = llvm::makeIntrusiveRefCnt<clang::DiagnosticOptions>();
+  clang::TextDiagnosticPrinter printer(os, diag_opts.get());
+  clang::DiagnosticsEngine diags(
+      llvm::makeIntrusiveRefCnt<clang::DiagnosticIDs>(), diag_opts, &printer,
+      false);
+  auto args = flags;
+  args.insert(args.end(), {"-o", pch, "-x", "c++-header"});
+  auto invocation = CreateInvocation(args, header, diags);
+  if (!invocation) {
+    os << "rcrl: couldn't create a compiler invocation\n";
+    return 1;
+  }
+  // a cached buffer of the previous pch would shadow the new one
+  impl_->module_cache = new clang::InMemoryModuleCache;
+  clang::CompilerInstance compiler;
+  compiler.setInvocation(invocation);
+  compiler.createDiagnostics(&printer, false);
+  clang::GeneratePCHAction action;
+  return compiler.ExecuteAction(action) ? 0 : 1;
+}
+
+int JitEngine::CompileSharedObject(const string& source,
+                                   const string& file_name,
+                                   const std::vector<string>& flags,
+                                   const std::vector<string>& link_flags,
+                                   const string& output_file, string& output) {
+  llvm::raw_string_ostream os(output);
+  auto diag_opts = llvm::makeIntrusiveRefCnt<clang::DiagnosticOptions>();
+  clang::TextDiagnosticPrinter printer(os, diag_opts.get());
+  clang::DiagnosticsEngine diags(
+      llvm::makeIntrusiveRefCnt<clang::DiagnosticIDs>(), diag_opts, &printer,
+      false);
+  const auto object_file = output_file + ".o";
+  auto args = flags;
+  args.insert(args.end(), {"-c", "-o", object_file});
+  auto invocation = CreateInvocation(args, file_name, diags);
+  if (!invocation) {
+    os << "rcrl: couldn't create a compiler invocation\n";
+    return 1;
+  }
+  invocation->getPreprocessorOpts().addRemappedFile(
+      file_name,
+      llvm::MemoryBuffer::getMemBufferCopy(source, file_name).release());
+  {
+    clang::CompilerInstance compiler(
+        std::make_shared<clang::PCHContainerOperations>(),
+        impl_->module_cache.get());
+    compiler.setInvocation(invocation);
+    compiler.createDiagnostics(&printer, false);
+    clang::EmitObjAction action;
+    if (!compiler.ExecuteAction(action)) {
+      return 1;
+    }
+  }
+
+  // only the linker is spawned, its output is collected through a log file
+  std::vector<const char*> link_args = {RCRL_CLANG_EXECUTABLE, "-shared",
+                                        object_file.c_str()};
+  for (const auto& flag : link_flags) {
+    link_args.push_back(flag.c_str());
+  }
+  link_args.insert(link_args.end(), {"-o", output_file.c_str()});
+  clang::driver::Driver driver(link_args[0], llvm::sys::getProcessTriple(),
+                               diags);
+  std::unique_ptr<clang::driver::Compilation> compilation(
+      driver.BuildCompilation(link_args));
+  if (!compilation) {
+    llvm::sys::fs::remove(object_file);
+    return 1;
+  }
+  const auto log_file = output_file + ".log";
+  compilation->Redirect({llvm::None, llvm::StringRef(log_file),
+                         llvm::StringRef(log_file)});
+  llvm::SmallVector<std::pair<int, const clang::driver::Command*>, 4> failing;
+  auto exit_code = driver.ExecuteCompilation(*compilation, failing);
+  if (auto log = llvm::MemoryBuffer::getFile(log_file)) {
+    os << (*log)->getBuffer();
+  }
+  llvm::sys::fs::remove(log_file);
+  llvm::sys::fs::remove(object_file);
+  return exit_code;
+}
+
+bool JitEngine::LoadLastCompiled(string& error) {
+  auto& jit = impl_->jit;
+  if (!jit || !impl_->pending) {
+    error = "rcrl: nothing to load\n";
+    return false;
+  }
+  auto dylib =
+      jit->createJITDylib("plugin_" + std::to_string(impl_->dylibs.size()));
+  if (!dylib) {
+    error = llvm::toString(dylib.takeError());
+    return false;
+  }
+  // newer plugins shadow older ones and the host process is searched last
+  for (auto it = impl_->dylibs.rbegin(); it != impl_->dylibs.rend(); ++it) {
+    dylib->addToLinkOrder(**it);
+  }
+  dylib->addToLinkOrder(jit->getMainJITDylib());
+  if (auto err = jit->addIRModule(*dylib, std::move(impl_->pending))) {
+    error = llvm::toString(std::move(err));
+    return false;
+  }
+  impl_->dylibs.push_back(&*dylib);
+  if (auto err = jit->initialize(*dylib)) {
+    error = llvm::toString(std::move(err));
+    return false;
+  }
+  return true;
+}
+
+void JitEngine::Reset() {
+  impl_->Deinitialize();
+  impl_->pending = llvm::orc::ThreadSafeModule();
+  string error;
+  impl_->jit = CreateJit(error);
+  if (!impl_->jit) {
+    llvm::errs() << "rcrl: couldn't create the jit: " << error << "\n";
+  }
+}
+
+}  // namespace rcrl
+
+#else
+
+namespace rcrl {
+
+struct JitEngine::Impl {};
+
+JitEngine::JitEngine() = default;
+JitEngine::~JitEngine() = default;
+
+bool JitEngine::IsAvailable() { return false; }
+
+int JitEngine::Compile(const string&, const string&, const std::vector<string>&,
+                       string& output) {
+  output += "rcrl: built without RCRL_WITH_JIT\n";
+  return 1;
+}
+
+int JitEngine::BuildPch(const string&, const string&,
+                        const std::vector<string>&, string& output) {
+  output += "rcrl: built without RCRL_WITH_JIT\n";
+  return 1;
+}
+
+int JitEngine::CompileSharedObject(const string&, const string&,
+                                   const std::vector<string>&,
+                                   const std::vector<string>&, const string&,
+                                   string& output) {
+  output += "rcrl: built without RCRL_WITH_JIT\n";
+  return 1;
+}
+
+bool JitEngine::LoadLastCompiled(string& error) {
+  error = "rcrl: built without RCRL_WITH_JIT\n";
+  return false;
+}
+
+void JitEngine::Reset() {}
+
+}  // namespace rcrl
+
+#endif
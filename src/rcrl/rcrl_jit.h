@@ -0,0 +1,41 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace rcrl {
+using std::string;
+
+// Compiles plugin sources in process with the clang frontend and links them
+// into an ORC JIT session that resolves against the host process symbols and
+// the previously loaded plugins - no child processes and no shared objects.
+// Only functional when built with RCRL_WITH_JIT.
+class JitEngine {
+ public:
+  JitEngine();
+  ~JitEngine();
+  static bool IsAvailable();
+  // flags are the same driver flags passed to clang++, file_name is only used
+  // for diagnostics and for resolving relative includes
+  int Compile(const string& source, const string& file_name,
+              const std::vector<string>& flags, string& output);
+  int BuildPch(const string& header, const string& pch,
+               const std::vector<string>& flags, string& output);
+  // compiles in process to an object file and links it with the system
+  // linker, used by the compile server which stays warm across submissions
+  int CompileSharedObject(const string& source, const string& file_name,
+                          const std::vector<string>& flags,
+                          const std::vector<string>& link_flags,
+                          const string& output_file, string& output);
+  // links the last compiled module and runs its static initializers
+  bool LoadLastCompiled(string& error);
+  // runs the static destructors of all loaded modules and starts over
+  void Reset();
+
+ private:
+  struct Impl;
+  std::unique_ptr<Impl> impl_;
+};
+
+}  // namespace rcrl
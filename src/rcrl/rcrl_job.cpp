@@ -0,0 +1,242 @@
+#include "rcrl_job.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <boost/asio.hpp>
+#include <boost/process.hpp>
+#include <boost/process/extend.hpp>
+#include <thread>
+#include <vector>
+
+#include "rcrl_trace.h"
+
+namespace bp = boost::process;
+
+namespace rcrl {
+
+namespace {
+
+// compiler output is small, diagnostics come a few lines at a time
+constexpr size_t kOutputChunk = 128;
+
+// runs in the forked child right before exec
+struct ProcessGroupAndLimits : bp::extend::handler {
+  uintmax_t max_memory;
+
+  template <class Executor>
+  void on_exec_setup(Executor&) const {
+    setpgid(0, 0);
+    if (max_memory) {
+      rlimit limit{max_memory, max_memory};
+      setrlimit(RLIMIT_AS, &limit);
+    }
+  }
+};
+
+}  // namespace
+
+CompileJob::CompileJob(CompileLimits limits) : limits_(limits) {}
+
+void CompileJob::Start() {
+  std::lock_guard<std::mutex> lock(mut_);
+  StartClock();
+}
+
+int CompileJob::Run(const string& cmd,
+                    const std::function<void(const char*, size_t)>& on_output,
+                    const string* input) {
+  std::vector<char> buf(kOutputChunk);
+  boost::asio::io_service ios;
+  bp::async_pipe ap(ios);
+  bp::async_pipe in(ios);
+  auto output_buffer = boost::asio::buffer(buf);
+  boost::asio::steady_timer timer(ios);
+  std::unique_lock<std::mutex> lock(mut_);
+  StartClock();
+  if (cancelled_ || IsPastDeadline()) {
+    timed_out_ = !cancelled_;
+    ReportStop(on_output);
+    return SIGKILL;
+  }
+  // a compiler that exits before reading its input must not kill the host
+  // with SIGPIPE, it is blocked on this thread and discarded afterwards
+  sigset_t sigpipe, old_mask;
+  sigemptyset(&sigpipe);
+  sigaddset(&sigpipe, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &sigpipe, &old_mask);
+  const auto spawn_start = std::chrono::steady_clock::now();
+  bp::child c =
+      input ? bp::child(cmd, (bp::std_err & bp::std_out) > ap,
+                        bp::std_in < in,
+                        ProcessGroupAndLimits{{}, limits_.max_memory})
+            : bp::child(cmd, (bp::std_err & bp::std_out) > ap,
+                        bp::std_in.close(),
+                        ProcessGroupAndLimits{{}, limits_.max_memory});
+  // also from the parent, a Kill before the child ran its setup would miss
+  // the group otherwise. Fails harmlessly once the child has exec'd
+  setpgid(c.id(), c.id());
+  process_group_ = c.id();
+  AddTraceEvent("spawn", spawn_start,
+                std::chrono::steady_clock::now() - spawn_start);
+  lock.unlock();
+
+  if (input) {
+    boost::asio::async_write(
+        in, boost::asio::buffer(*input),
+        [&](const boost::system::error_code&, std::size_t) { in.close(); });
+  } else {
+    in.close();
+  }
+
+  if (limits_.timeout.count()) {
+    timer.expires_at(deadline_);
+    timer.async_wait([&](const boost::system::error_code& ec) {
+      if (!ec) {
+        std::lock_guard<std::mutex> lock(mut_);
+        timed_out_ = true;
+        Kill();
+      }
+    });
+  }
+  auto OnStdout = [&](const boost::system::error_code& ec, std::size_t size) {
+    auto lambda_impl = [&](const boost::system::error_code& ec, std::size_t n,
+                           auto& lambda_ref) {
+      on_output(buf.data(), n);
+      if (!ec && ap.is_open()) {
+        ap.async_read_some(output_buffer,
+                           std::bind(lambda_ref, std::placeholders::_1,
+                                     std::placeholders::_2, lambda_ref));
+      } else {
+        // the pipe is closed once the whole group is gone
+        timer.cancel();
+      }
+    };
+    return lambda_impl(ec, size, lambda_impl);
+  };
+  ap.async_read_some(output_buffer, OnStdout);
+  ios.run();
+  c.join();
+  const timespec no_wait = {0, 0};
+  while (sigtimedwait(&sigpipe, nullptr, &no_wait) > 0) {
+  }
+  pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+
+  lock.lock();
+  process_group_ = 0;
+  ReportStop(on_output);
+  return c.exit_code();
+}
+
+int CompileJob::Attach(
+    pid_t process, const std::function<int()>& work,
+    const std::function<void(const char*, size_t)>& on_output) {
+  std::unique_lock<std::mutex> lock(mut_);
+  StartClock();
+  if (cancelled_ || IsPastDeadline()) {
+    timed_out_ = !cancelled_;
+    ReportStop(on_output);
+    return SIGKILL;
+  }
+  attached_ = process;
+  // the pipes to the process break when it is killed
+  sigset_t sigpipe, old_mask;
+  sigemptyset(&sigpipe);
+  sigaddset(&sigpipe, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &sigpipe, &old_mask);
+  std::thread watchdog;
+  if (limits_.timeout.count()) {
+    watchdog = std::thread([this] {
+      std::unique_lock<std::mutex> lock(mut_);
+      if (!attached_cv_.wait_until(lock, deadline_,
+                                   [this] { return !attached_; })) {
+        timed_out_ = true;
+        Kill();
+      }
+    });
+  }
+  lock.unlock();
+
+  auto exit_code = work();
+
+  lock.lock();
+  attached_ = 0;
+  lock.unlock();
+  attached_cv_.notify_all();
+  if (watchdog.joinable()) {
+    watchdog.join();
+  }
+  const timespec no_wait = {0, 0};
+  while (sigtimedwait(&sigpipe, nullptr, &no_wait) > 0) {
+  }
+  pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+  lock.lock();
+  if (timed_out_ || cancelled_) {
+    exit_code = SIGKILL;
+  }
+  ReportStop(on_output);
+  return exit_code;
+}
+
+void CompileJob::Cancel() {
+  std::lock_guard<std::mutex> lock(mut_);
+  cancelled_ = true;
+  Kill();
+}
+
+bool CompileJob::IsCancelled() {
+  std::lock_guard<std::mutex> lock(mut_);
+  timed_out_ = timed_out_ || (!cancelled_ && IsPastDeadline());
+  return cancelled_ || timed_out_;
+}
+
+bool CompileJob::IsTimedOut() {
+  std::lock_guard<std::mutex> lock(mut_);
+  return timed_out_;
+}
+
+string CompileJob::GetStopReason() {
+  std::lock_guard<std::mutex> lock(mut_);
+  return StopMessage();
+}
+
+void CompileJob::StartClock() {
+  if (!started_) {
+    started_ = true;
+    deadline_ = std::chrono::steady_clock::now() + limits_.timeout;
+  }
+}
+
+bool CompileJob::IsPastDeadline() {
+  return started_ && limits_.timeout.count() &&
+         std::chrono::steady_clock::now() >= deadline_;
+}
+
+void CompileJob::Kill() {
+  if (process_group_ > 0) {
+    kill(-process_group_, SIGKILL);
+  }
+  if (attached_ > 0) {
+    kill(attached_, SIGKILL);
+  }
+}
+
+string CompileJob::StopMessage() {
+  if (timed_out_) {
+    return "rcrl: compile timed out after " +
+           std::to_string(limits_.timeout.count()) + " ms\n";
+  }
+  return cancelled_ ? "rcrl: compile cancelled\n" : "";
+}
+
+void CompileJob::ReportStop(
+    const std::function<void(const char*, size_t)>& on_output) {
+  const auto message = StopMessage();
+  if (!message.empty()) {
+    on_output(message.data(), message.size());
+  }
+}
+
+}  // namespace rcrl
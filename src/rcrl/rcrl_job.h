@@ -0,0 +1,70 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+
+namespace rcrl {
+using std::string;
+
+// zero means unlimited
+struct CompileLimits {
+  // wall clock, for the whole job from Start or its first process
+  std::chrono::milliseconds timeout{0};
+  uintmax_t max_memory = 0;              // address space of each process
+};
+
+// Handle of one compile that may run several compiler processes (pch and
+// shared object). Each process gets its own process group so killing it
+// also stops the linker and anything else the clang driver spawned.
+class CompileJob {
+ public:
+  explicit CompileJob(CompileLimits limits = {});
+  // starts the clock of the timeout, once. Time spent waiting for a worker
+  // doesn't count, the first Run or Attach starts it otherwise
+  void Start();
+  // runs cmd until it exits, gets cancelled or hits the deadline, the
+  // output is drained into on_output in every case. input is written to the
+  // standard input of the process, which is closed right away without it
+  int Run(const string& cmd,
+          const std::function<void(const char*, size_t)>& on_output,
+          const string* input = nullptr);
+  // runs work, which waits on process, a long lived one that isn't the
+  // job's own, e.g. a compile server. Cancelling or reaching the deadline
+  // kills process so that work returns, the output is reported to on_output
+  // like for Run
+  int Attach(pid_t process, const std::function<int()>& work,
+             const std::function<void(const char*, size_t)>& on_output);
+  // thread safe, also fails every later Run right away
+  void Cancel();
+  // also true once the deadline passed, even without a process to kill
+  bool IsCancelled();
+  bool IsTimedOut();
+  // why the job stopped early, empty while it may go on
+  string GetStopReason();
+
+ private:
+  // all with mut_ held
+  void StartClock();
+  bool IsPastDeadline();
+  void Kill();
+  string StopMessage();
+  void ReportStop(const std::function<void(const char*, size_t)>& on_output);
+
+  const CompileLimits limits_;
+  std::chrono::steady_clock::time_point deadline_;
+  bool started_ = false;
+  std::mutex mut_;
+  bool cancelled_ = false;
+  bool timed_out_ = false;
+  pid_t process_group_ = 0;
+  pid_t attached_ = 0;  // of Attach, not a group
+  std::condition_variable attached_cv_;
+};
+
+}  // namespace rcrl
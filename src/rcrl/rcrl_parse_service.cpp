@@ -0,0 +1,124 @@
+#include "rcrl_parse_service.h"
+
+#include <unistd.h>
+
+#include <atomic>
+#include <cassert>
+#include <fstream>
+
+#include "rcrl_cache.h"
+
+namespace rcrl {
+
+namespace {
+
+fs::path NewServiceDirectory() {
+  static std::atomic<unsigned> service_count(0);
+  auto dir = fs::temp_directory_path() /
+             ("rcrl_parse_" + std::to_string(getpid()) + "_" +
+              std::to_string(service_count++));
+  fs::create_directories(dir);
+  return dir;
+}
+
+}  // namespace
+
+ParseService::ParseService(size_t workers, size_t max_memory_bytes)
+    : dir_(NewServiceDirectory()),
+      max_memory_bytes_(max_memory_bytes),
+      index_(clang_createIndex(0, 0)),
+      workers_(workers) {}
+
+ParseService::~ParseService() {
+  assert(memory_.empty());
+  clang_disposeIndex(index_);
+  std::error_code ec;
+  fs::remove_all(dir_, ec);
+}
+
+CXIndex ParseService::get_index() { return index_; }
+
+void ParseService::Run(const string& session,
+                       const std::function<void()>& parse) {
+  workers_
+      .Submit(session,
+              [&parse]() {
+                parse();
+                return 0;
+              })
+      .get();
+}
+
+fs::path ParseService::GetPreamble(const string& text,
+                                   const std::vector<string>& flags) {
+  Hasher hasher;
+  hasher.Update(text);
+  for (const auto& flag : flags) {
+    hasher.Update(flag);
+  }
+  const auto key = hasher.Digest();
+  std::lock_guard<std::mutex> lock(preamble_mut_);
+  auto it = preambles_.find(key);
+  if (it != preambles_.end()) {
+    return it->second;
+  }
+  // the pch checks the header it was built from, so it is never rewritten
+  const auto header = dir_ / ("prelude_" + key + ".hpp");
+  std::ofstream(header, std::fstream::out | std::fstream::trunc) << text;
+  std::vector<const char*> args = {"-x", "c++-header"};
+  for (const auto& flag : flags) {
+    args.push_back(flag.c_str());
+  }
+  auto unit = clang_parseTranslationUnit(
+      index_, header.c_str(), args.data(), args.size(), nullptr, 0,
+      CXTranslationUnit_ForSerialization | CXTranslationUnit_Incomplete);
+  auto pch = header;
+  pch.replace_extension(".pch");
+  if (!unit || clang_saveTranslationUnit(unit, pch.c_str(),
+                                         CXSaveTranslationUnit_None) !=
+                   CXSaveError_None) {
+    // parsers fall back to parsing the prelude themselves
+    pch.clear();
+  }
+  if (unit) {
+    clang_disposeTranslationUnit(unit);
+  }
+  preambles_[key] = pch;
+  return pch;
+}
+
+size_t ParseService::UpdateMemory(const void* parser, size_t bytes) {
+  std::lock_guard<std::mutex> lock(memory_mut_);
+  memory_[parser] = bytes;
+  size_t total = 0;
+  for (const auto& entry : memory_) {
+    total += entry.second;
+  }
+  return max_memory_bytes_ && total > max_memory_bytes_
+             ? total - max_memory_bytes_
+             : 0;
+}
+
+void ParseService::ReleaseMemory(const void* parser) {
+  std::lock_guard<std::mutex> lock(memory_mut_);
+  memory_.erase(parser);
+}
+
+ParseServiceStats ParseService::get_stats() {
+  ParseServiceStats stats;
+  stats.max_memory_bytes = max_memory_bytes_;
+  {
+    std::lock_guard<std::mutex> lock(memory_mut_);
+    stats.parsers = memory_.size();
+    for (const auto& entry : memory_) {
+      stats.memory_bytes += entry.second;
+    }
+  }
+  std::lock_guard<std::mutex> lock(preamble_mut_);
+  for (const auto& entry : preambles_) {
+    stats.preambles += !entry.second.empty();
+  }
+  return stats;
+}
+
+}  // namespace rcrl
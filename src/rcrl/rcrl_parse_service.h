@@ -0,0 +1,64 @@
+#pragma once
+
+#include <clang-c/Index.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rcrl_scheduler.h"
+
+namespace fs = std::filesystem;
+
+namespace rcrl {
+using std::string;
+
+struct ParseServiceStats {
+  size_t parsers = 0;       // parsers with units
+  size_t memory_bytes = 0;  // of the units of all parsers
+  size_t max_memory_bytes = 0;
+  size_t preambles = 0;  // precompiled preludes
+};
+
+// Parsing shared by the parsers of many sessions: one CXIndex, a fixed number
+// of workers doing the parses and reparses round robin by session, preludes
+// precompiled once per text and flags, and a bound on the memory of the
+// translation units of all parsers together.
+class ParseService {
+ public:
+  // max_memory_bytes 0 means unbounded
+  explicit ParseService(
+      size_t workers = std::max(1u, std::thread::hardware_concurrency()),
+      size_t max_memory_bytes = 0);
+  // the parsers have to be gone or switched to another service before
+  ~ParseService();
+  CXIndex get_index();
+  // runs parse on a worker, returns once it finished
+  void Run(const string& session, const std::function<void()>& parse);
+  // pch of the header text built with flags, shared by the parsers of all
+  // sessions, an empty path when it doesn't build
+  fs::path GetPreamble(const string& text, const std::vector<string>& flags);
+  // records the memory of the units of a parser, returns by how much the
+  // parsers together exceed the budget, 0 when within it
+  size_t UpdateMemory(const void* parser, size_t bytes);
+  void ReleaseMemory(const void* parser);
+  ParseServiceStats get_stats();
+
+ private:
+  const fs::path dir_;
+  const size_t max_memory_bytes_;
+  CXIndex index_;
+  CompileScheduler workers_;
+  std::mutex preamble_mut_;  // held while building, they are rare
+  std::map<string, fs::path> preambles_;  // by digest, empty if failed
+  std::mutex memory_mut_;
+  std::map<const void*, size_t> memory_;  // by parser
+};
+
+}  // namespace rcrl
@@ -4,8 +4,11 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cctype>
+#include <cstdint>
 #include <cstring>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <string>
@@ -13,6 +16,7 @@
 
 #include "clang-c/CXString.h"
 #include "config.h"
+#include "rcrl_trace.h"
 
 using std::cerr;
 using std::cout;
@@ -35,6 +39,112 @@ std::ostream& operator<<(std::ostream& out, const CodeBlock& p) {
   return out << p.start_pos.line << ":" << p.start_pos.column;
 }
 
+// true unless text is only blanks, semicolons and comments
+bool HasCode(std::string_view text) {
+  for (size_t i = 0; i < text.size(); ++i) {
+    if (text.compare(i, 2, "//") == 0) {
+      i = std::min(text.find('\n', i), text.size());
+    } else if (text.compare(i, 2, "/*") == 0) {
+      i = std::min(text.find("*/", i + 2), text.size()) + 1;
+    } else if (!std::isspace(static_cast<unsigned char>(text[i])) &&
+               text[i] != ';') {
+      return true;
+    }
+  }
+  return false;
+}
+
+string ToAddress(const void* p) {
+  return std::to_string(reinterpret_cast<uintptr_t>(p)) + "u";
+}
+// the reference every plugin uses to reach the variable in its slot
+string ArenaReference(const string& type, const string& name, void* slot) {
+  return "static " + type + "& " + name + " = *reinterpret_cast<" + type +
+         "*>(" + ToAddress(slot) + ")";
+}
+string GetSymbol(CXCursor c) {
+  CXString symbol = clang_Cursor_getMangling(c);
+  string out = clang_getCString(symbol);
+  clang_disposeString(symbol);
+  return out;
+}
+// symbol of a variable that got wrapped in the inline namespace of the
+// session, which goes innermost, right before the name
+string GetSessionSymbol(const string& session, const string& symbol,
+                        const string& name) {
+  const auto component = std::to_string(session.size()) + session;
+  const auto last = std::to_string(name.size()) + name + "E";
+  // names in the global namespace aren't mangled
+  if (symbol == name) {
+    return "_ZN" + component + last;
+  }
+  if (symbol.rfind("_ZN", 0) == 0 && symbol.size() > last.size() &&
+      symbol.compare(symbol.size() - last.size(), last.size(), last) == 0) {
+    return string(symbol).insert(symbol.size() - last.size(), component);
+  }
+  return symbol;
+}
+// true when an object of the type may hold an address, e.g. of a string
+// literal, a variable or a function, which may be one into a plugin
+bool HoldsAddress(CXType type) {
+  type = clang_getCanonicalType(type);
+  switch (type.kind) {
+    case CXType_Pointer:
+    case CXType_BlockPointer:
+    case CXType_LValueReference:
+    case CXType_RValueReference:
+    case CXType_ObjCObjectPointer:
+    case CXType_MemberPointer:
+      return true;
+    case CXType_ConstantArray:
+    case CXType_IncompleteArray:
+    case CXType_VariableArray:
+    case CXType_DependentSizedArray:
+      return HoldsAddress(clang_getArrayElementType(type));
+    case CXType_Record: {
+      // the fields, the bases and the members of anonymous unions and
+      // structs, recursively
+      bool holds = false;
+      clang_visitChildren(
+          clang_getTypeDeclaration(type),
+          [](CXCursor c, CXCursor, CXClientData holds_ptr) {
+            const auto kind = clang_getCursorKind(c);
+            if ((kind == CXCursor_FieldDecl ||
+                 kind == CXCursor_CXXBaseSpecifier ||
+                 clang_Cursor_isAnonymousRecordDecl(c)) &&
+                HoldsAddress(clang_getCursorType(c))) {
+              *static_cast<bool*>(holds_ptr) = true;
+              return CXChildVisit_Break;
+            }
+            return CXChildVisit_Continue;
+          },
+          &holds);
+      return holds;
+    }
+    default:
+      return false;
+  }
+}
+// true when word appears in text as a whole identifier
+bool HasWord(const string& text, const string& word) {
+  auto is_identifier = [](char c) {
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+  };
+  for (auto pos = text.find(word); pos != string::npos;
+       pos = text.find(word, pos + 1)) {
+    const auto end = pos + word.size();
+    if ((pos == 0 || !is_identifier(text[pos - 1])) &&
+        (end == text.size() || !is_identifier(text[end]))) {
+      return true;
+    }
+  }
+  return false;
+}
+string ArenaType(void* slot) {
+  return "__rcrl_slot_" + std::to_string(reinterpret_cast<uintptr_t>(slot)) +
+         "_t";
+}
+
 auto AstVisitor(CXCursor c, CXCursor parent, CXClientData code_blocks_ptr) {
   // supress compiler warnning
   (void)parent;
@@ -83,69 +193,244 @@ void GenerateCodeBlocksFromAst(CXTranslationUnit ast,
   clang_visitChildren(cursor, AstVisitor, code_blocks_ptr);
 }
 
-void PluginParser::Parse() {
-  std::ifstream file(file_path_, std::fstream::in);
-  string line;
-  file_content_.clear();
-  while (std::getline(file, line)) {
-    file_content_.emplace_back(line + "\n");
+void PluginParser::ReadFile() {
+  std::ifstream file(file_path_, std::fstream::in | std::fstream::binary);
+  source_.clear();
+  if (file) {
+    file.seekg(0, std::ios::end);
+    source_.resize(static_cast<size_t>(file.tellg()));
+    file.seekg(0, std::ios::beg);
+    file.read(&source_[0], source_.size());
+  }
+  IndexLines();
+}
+
+void PluginParser::IndexLines() {
+  // every line ends with a newline, as getline based parsing had it
+  if (!source_.empty() && source_.back() != '\n') {
+    source_ += '\n';
+  }
+  line_offsets_.clear();
+  line_offsets_.push_back(0);
+  for (size_t i = 0; i < source_.size(); ++i) {
+    if (source_[i] == '\n') {
+      line_offsets_.push_back(i + 1);
+    }
   }
-  file.close();
+}
+
+CXUnsavedFile PluginParser::GetUnsavedFile() {
+  CXUnsavedFile file;
+  file.Filename = file_path_.c_str();
+  file.Contents = source_.data();
+  file.Length = source_.size();
+  return file;
+}
+
+string NormalizeFlags(const std::vector<string>& flags) {
+  // the order and repetitions matter, e.g. -Xclang applies to the next
+  // flag only, so just the blanks go. One per line, a flag may have spaces
+  string key;
+  for (const auto& flag : flags) {
+    auto begin = flag.find_first_not_of(" \t\n");
+    if (begin == string::npos) {
+      continue;
+    }
+    auto end = flag.find_last_not_of(" \t\n") + 1;
+    key += (key.empty() ? "" : "\n") + flag.substr(begin, end - begin);
+  }
+  return key;
+}
+
+void PluginParser::RunParse(const std::function<void()>& parse) {
+  if (service_) {
+    service_->Run(file_path_.string(), parse);
+  } else {
+    parse();
+  }
+}
+
+CXTranslationUnit PluginParser::ParseUnit() {
+  CXTranslationUnit unit = nullptr;
+  RunParse([&]() {
+    std::vector<const char*> flags;
+    for (const auto& f : flags_) {
+      flags.push_back(f.c_str());
+    }
+    // the prelude precompiled by the service stands in for parsing it, the
+    // include guard of the prelude skips the copy the file includes
+    fs::path preamble;
+    if (service_ && !prelude_.empty()) {
+      preamble = service_->GetPreamble(prelude_, flags_);
+    }
+    if (!preamble.empty()) {
+      flags.push_back("-include-pch");
+      flags.push_back(preamble.c_str());
+    }
+    auto unsaved = GetUnsavedFile();
+    TraceScope trace("clang_parseTranslationUnit");
+    unit = clang_parseTranslationUnit(
+        service_ ? service_->get_index() : index_, file_path_.c_str(),
+        flags.data(), flags.size(), &unsaved, 1,
+        CXTranslationUnit_DetailedPreprocessingRecord |  // readable headers
+            CXTranslationUnit_Incomplete | CXTranslationUnit_KeepGoing |
+            CXTranslationUnit_CreatePreambleOnFirstParse |
+            CXTranslationUnit_IgnoreNonErrorsFromIncludedFiles |
+            CXTranslationUnit_IncludeAttributedTypes);
+  });
+  return unit;
+}
+
+CXTranslationUnit PluginParser::GetUnit() { return units_.front().unit; }
+
+void PluginParser::DisposeUnit(CXTranslationUnit unit) {
+  // the blocks refer to the cursors of the unit
+  if (!code_blocks_.empty() &&
+      clang_Cursor_getTranslationUnit(code_blocks_.front().cursor) == unit) {
+    code_blocks_.clear();
+  }
+  clang_disposeTranslationUnit(unit);
+}
+
+void PluginParser::Parse() {
+  ReadFile();
   code_blocks_.clear();
-  name_space_end_.clear();
-  CXIndex index = clang_createIndex(0, 0);
-  std::vector<const char*> flags(flags_.size());
-  auto i = 0;
-  for (const auto& f : flags_) {
-    flags[i++] = f.c_str();
-  }
-  CXTranslationUnit ast = clang_parseTranslationUnit(
-      index, file_path_.c_str(), flags.data(), flags.size(), nullptr, 0,
-      CXTranslationUnit_DetailedPreprocessingRecord |  // make headers readable
-          CXTranslationUnit_Incomplete | CXTranslationUnit_KeepGoing |
-          CXTranslationUnit_CreatePreambleOnFirstParse |
-          CXTranslationUnit_IgnoreNonErrorsFromIncludedFiles |
-          CXTranslationUnit_IncludeAttributedTypes);
-  GenerateCodeBlocksFromAst(ast, &code_blocks_);
-  ast_ = std::make_tuple(index, ast);
+  namespaces_.clear();
+  index_ = clang_createIndex(0, 0);
+  ResetUnits();
+}
+
+void PluginParser::ResetUnits() {
+  for (const auto& unit : units_) {
+    DisposeUnit(unit.unit);
+  }
+  units_.clear();
+  units_.push_front({NormalizeFlags(flags_), ParseUnit()});
+  GenerateCodeBlocksFromAst(GetUnit(), &code_blocks_);
+  EvictUnits();
 }
 
 void PluginParser::UpdateAstWithOtherFlags() {
-  auto [i, tu] = ast_;
-  clang_disposeTranslationUnit(tu);
-  std::vector<const char*> flags(flags_.size());
-  auto ix = 0;
-  for (const auto& f : flags_) {
-    flags[ix++] = f.c_str();
-  }
-  CXTranslationUnit ast = clang_parseTranslationUnit(
-      i, file_path_.c_str(), flags.data(), flags.size(), nullptr, 0,
-      CXTranslationUnit_DetailedPreprocessingRecord |  // make headers readable
-          CXTranslationUnit_Incomplete | CXTranslationUnit_KeepGoing |
-          CXTranslationUnit_CreatePreambleOnFirstParse |
-          CXTranslationUnit_IgnoreNonErrorsFromIncludedFiles |
-          CXTranslationUnit_IncludeAttributedTypes);
-  ast_ = std::make_tuple(i, ast);
+  auto key = NormalizeFlags(flags_);
+  auto it = std::find_if(units_.begin(), units_.end(),
+                         [&](const Unit& unit) { return unit.flags == key; });
+  if (it != units_.end()) {
+    // parsed with the flags of another profile, the next reparse updates it
+    units_.splice(units_.begin(), units_, it);
+    return;
+  }
+  units_.push_front({key, ParseUnit()});
+  EvictUnits();
+}
+
+void PluginParser::EvictUnits() {
+  while (units_.size() > std::max<size_t>(max_units_, 1)) {
+    DisposeUnit(units_.back().unit);
+    units_.pop_back();
+  }
+  if (!service_) {
+    return;
+  }
+  // over the budget of the service the units of other flags go first, the
+  // current one is in use. The other parsers trim theirs when they parse next
+  size_t memory = 0;
+  for (const auto& unit : units_) {
+    memory += GetUnitMemory(unit.unit);
+  }
+  while (service_->UpdateMemory(this, memory) && units_.size() > 1) {
+    memory -= GetUnitMemory(units_.back().unit);
+    DisposeUnit(units_.back().unit);
+    units_.pop_back();
+  }
+}
+
+size_t PluginParser::GetUnitMemory(CXTranslationUnit unit) {
+  // the ast, the preamble buffers, the source manager and so on
+  size_t bytes = 0;
+  auto usage = clang_getCXTUResourceUsage(unit);
+  for (unsigned i = 0; i < usage.numEntries; ++i) {
+    bytes += usage.entries[i].amount;
+  }
+  clang_disposeCXTUResourceUsage(usage);
+  return bytes;
+}
+
+bool PluginParser::HasUnit(const std::vector<string>& flags) {
+  auto key = NormalizeFlags(flags);
+  return std::any_of(units_.begin(), units_.end(),
+                     [&](const Unit& unit) { return unit.flags == key; });
+}
+
+void PluginParser::set_max_units(size_t units) {
+  max_units_ = units;
+  EvictUnits();
+}
+
+std::vector<UnitStats> PluginParser::GetUnitStats() {
+  std::vector<UnitStats> stats;
+  for (const auto& unit : units_) {
+    UnitStats entry;
+    entry.flags = unit.flags;
+    entry.current = (unit.unit == GetUnit());
+    entry.memory_bytes = GetUnitMemory(unit.unit);
+    stats.emplace_back(std::move(entry));
+  }
+  return stats;
 }
 
 void PluginParser::Reparse() {
-  std::ifstream file(file_path_, std::fstream::in);
-  string line;
-  file_content_.clear();
-  while (std::getline(file, line)) {
-    file_content_.emplace_back(line + "\n");
-  }
-  file.close();
-  name_space_end_.clear();
+  ReadFile();
+  ReparseSource();
+}
+
+void PluginParser::Reparse(string contents) {
+  source_ = std::move(contents);
+  IndexLines();
+  ReparseSource();
+}
+
+void PluginParser::ReparseSource() {
+  TraceScope trace("Reparse");
+  namespaces_.clear();
   code_blocks_.clear();
-  auto ast = std::get<1>(ast_);
-  clang_reparseTranslationUnit(ast, 0, 0, CXReparse_None);
-  GenerateCodeBlocksFromAst(ast, &code_blocks_);
+  auto ast = GetUnit();
+  // libclang reads the buffer instead of the file
+  auto unsaved = GetUnsavedFile();
+  RunParse([&]() {
+    TraceScope trace("clang_reparseTranslationUnit");
+    clang_reparseTranslationUnit(ast, 1, &unsaved, CXReparse_None);
+  });
+  {
+    TraceScope trace("GenerateCodeBlocksFromAst");
+    GenerateCodeBlocksFromAst(ast, &code_blocks_);
+  }
+  EvictUnits();
+}
+
+void PluginParser::set_service(ParseService* service) {
+  if (service == service_) {
+    return;
+  }
+  if (service_) {
+    service_->ReleaseMemory(this);
+  }
+  service_ = service;
+  ResetUnits();
+}
+
+void PluginParser::set_prelude(string text) {
+  if (text == prelude_) {
+    return;
+  }
+  prelude_ = std::move(text);
+  // only parses with a service use it
+  if (service_) {
+    ResetUnits();
+  }
 }
 
 PluginParser::PluginParser(fs::path file, std::vector<string> flags)
-    : generated_file_content_(""),
-      flags_(flags),
+    : flags_(flags),
       file_path_(file),
       code_gen_number_(0) {
   // create empty file
@@ -155,138 +440,507 @@ PluginParser::PluginParser(fs::path file, std::vector<string> flags)
 }
 
 PluginParser::~PluginParser() {
-  auto [i, ast] = ast_;
-  clang_disposeTranslationUnit(ast);
-  clang_disposeIndex(i);
+  for (const auto& unit : units_) {
+    clang_disposeTranslationUnit(unit.unit);
+  }
+  if (service_) {
+    service_->ReleaseMemory(this);
+  }
+  clang_disposeIndex(index_);
 }
 
 fs::path PluginParser::get_file() { return file_path_; }
 std::vector<string> PluginParser::get_flags() { return flags_; }
+const string& PluginParser::get_generated_source() {
+  return source_output_.text;
+}
+std::vector<Diagnostic> PluginParser::GetHardErrors() {
+  std::vector<Diagnostic> diagnostics;
+  auto ast = GetUnit();
+  for (unsigned i = 0, n = clang_getNumDiagnostics(ast); i < n; ++i) {
+    auto d = clang_getDiagnostic(ast, i);
+    AppendDiagnostic(d, diagnostics);
+    clang_disposeDiagnostic(d);
+  }
+  std::vector<Diagnostic> errors;
+  for (auto& d : diagnostics) {
+    if (d.severity < Severity::kError ||
+        fs::path(d.file).lexically_normal() != file_path_.lexically_normal()) {
+      continue;
+    }
+    // the parse sees a redefinition outside the session namespace, so its
+    // uses are ambiguous with the definition the header declares
+    if (!session_.empty() && d.message.find("is ambiguous") != string::npos) {
+      continue;
+    }
+    const Point p = {d.line, d.column};
+    // namespaces may hold statements too, their members are checked instead
+    auto in_declaration =
+        std::any_of(code_blocks_.begin(), code_blocks_.end(),
+                    [&](const CodeBlock& code) {
+                      return clang_getCursorKind(code.cursor) !=
+                                 CXCursor_Namespace &&
+                             !(p < code.start_pos) && p < code.end_pos;
+                    });
+    if (d.severity == Severity::kFatal || in_declaration) {
+      // the first line includes the accumulated header
+      d.code_line = d.line > 1 ? d.line - 1 : 0;
+      errors.emplace_back(std::move(d));
+    }
+  }
+  return errors;
+}
+unsigned int PluginParser::GetSourceLine(unsigned int generated_line) {
+  const auto& line_map = source_output_.line_map;
+  return generated_line && generated_line <= line_map.size()
+             ? line_map[generated_line - 1]
+             : 0;
+}
+void PluginParser::Output::Append(std::string_view str,
+                                  unsigned int source_line) {
+  for (auto ch : str) {
+    // a line takes the source line of the first user text on it
+    if (!line_map.back()) {
+      line_map.back() = source_line;
+    }
+    if (ch == '\n') {
+      line_map.push_back(0);
+      if (source_line) {
+        source_line++;
+      }
+    }
+  }
+  text.append(str.data(), str.size());
+}
+void PluginParser::Output::Reset(size_t expected_size, size_t expected_lines) {
+  text.clear();
+  text.reserve(expected_size);
+  line_map.clear();
+  line_map.reserve(expected_lines + 1);
+  line_map.push_back(0);
+  open_namespaces = 0;
+}
+unsigned int PluginParser::get_code_gen_number() { return code_gen_number_; }
+void PluginParser::set_code_gen_number(unsigned int number) {
+  code_gen_number_ = number;
+}
+void PluginParser::set_session(string name) { session_ = std::move(name); }
+bool PluginParser::IsInSession(const CodeBlock& code) {
+  auto c = code.cursor;
+  if (session_.empty() || (clang_getCursorKind(c) != CXCursor_VarDecl &&
+                           clang_getCursorKind(c) != CXCursor_FunctionDecl)) {
+    return false;
+  }
+  // qualified definitions have to stay in their namespace or class
+  return clang_equalCursors(clang_getCursorSemanticParent(c),
+                            clang_getCursorLexicalParent(c));
+}
+void PluginParser::set_arena(VariableArena* arena) {
+  arena_ = arena;
+  arena_slots_.clear();
+}
+void* PluginParser::GetArenaSlot(CXCursor c) {
+  auto it = arena_slots_.find(GetSymbol(c));
+  return it == arena_slots_.end() ? nullptr : it->second;
+}
+bool PluginParser::AppendArenaVariable(CodeBlock code) {
+  auto c = code.cursor;
+  auto type = clang_getCursorType(c);
+  auto size = clang_Type_getSizeOf(type);
+  auto align = clang_Type_getAlignOf(type);
+  CXString type_str = clang_getTypeSpelling(type);
+  CXString name_str = clang_getCursorSpelling(c);
+  CXString symbol_str = clang_Cursor_getMangling(c);
+  const string type_name = clang_getCString(type_str);
+  const string name = clang_getCString(name_str);
+  const string symbol = clang_getCString(symbol_str);
+  clang_disposeString(type_str);
+  clang_disposeString(name_str);
+  clang_disposeString(symbol_str);
+  // the type is spelled out, so it must have a name. An object that isn't
+  // a POD type may hold a vptr or function pointers into the plugin, e.g. a
+  // std::function, and any pointer may point into it, e.g. to a string
+  // literal, which the arena would outlive. So nothing in the arena needs
+  // to be destroyed
+  if (clang_getCursorLinkage(c) != CXLinkage_External || size < 0 ||
+      align < 0 || type_name.find('(') != string::npos ||
+      !clang_isPODType(type) || HoldsAddress(type)) {
+    return false;
+  }
+  // the initializer follows the name
+  unsigned int line, column;
+  clang_getExpansionLocation(clang_getCursorLocation(c), nullptr, &line,
+                             &column, nullptr);
+  Point after_name = {line, column + static_cast<unsigned int>(name.size())};
+  auto init = string(GetRange(after_name, code.end_pos));
+  init.erase(0, init.find_first_not_of(" \t\n"));
+  if (!init.empty() && init[0] == '[') {
+    return false;
+  }
+  if (!init.empty() && init[0] == '=') {
+    init.erase(0, init.find_first_not_of(" \t\n", 1));
+    if (init.empty() || init[0] != '{') {
+      init = "(" + init + ")";
+    }
+  }
+  // a failed compile submitted again, or a redefinition of the same type,
+  // gets the same slot, so slots only grow with the variables
+  auto slot = arena_->Allocate(symbol + "#" + type_name, size, align);
+  if (!slot) {
+    return false;
+  }
+  arena_slots_[symbol] = slot;
+  const auto alias = ArenaType(slot);
+  AppendValidCodeBlock(
+      source_output_, code,
+      "using " + alias + " = " + type_name + ";\nstatic " + alias +
+                "& " + name + " = *::new (reinterpret_cast<void*>(" +
+                ToAddress(slot) + ")) " + alias + init);
+  return true;
+}
+void PluginParser::set_trampolines(TrampolineTable* trampolines) {
+  trampolines_ = trampolines;
+  trampoline_code_.clear();
+}
+bool PluginParser::AppendTrampolineFunction(CodeBlock code) {
+  auto c = code.cursor;
+  CXString name_str = clang_getCursorSpelling(c);
+  CXString type_str = clang_getTypeSpelling(clang_getCursorType(c));
+  CXString result_str =
+      clang_getTypeSpelling(clang_getResultType(clang_getCursorType(c)));
+  const string name = clang_getCString(name_str);
+  const string type = clang_getCString(type_str);
+  const string result = clang_getCString(result_str);
+  clang_disposeString(name_str);
+  clang_disposeString(type_str);
+  clang_disposeString(result_str);
+  if (clang_getCursorLinkage(c) != CXLinkage_External ||
+      clang_Cursor_isVariadic(c) || name.rfind("operator", 0) == 0 ||
+      name == "main") {
+    return false;
+  }
+  unsigned int line, column;
+  clang_getExpansionLocation(clang_getCursorLocation(c), nullptr, &line,
+                             &column, nullptr);
+  const Point name_pos = {line, column};
+  const Point after_name = {line,
+                            column + static_cast<unsigned int>(name.size())};
+  const string head(GetRange(code.start_pos, name_pos));
+  // hot functions, constant expressions and out of line members are called
+  // directly. So are heads the body can't be declared static with, e.g.
+  // with attributes, a linkage specification or a template head
+  auto head_end = head.find_last_not_of(" \t\n");
+  if (HasWord(head, "RCRL_DIRECT") || HasWord(head, "constexpr") ||
+      HasWord(head, "consteval") || HasWord(head, "extern") ||
+      HasWord(head, "template") || HasWord(head, "__attribute__") ||
+      HasWord(head, "__declspec") || HasWord(head, "alignas") ||
+      head.find("[[") != string::npos ||
+      (head_end != string::npos && head_end > 0 &&
+       head.compare(head_end - 1, 2, "::") == 0)) {
+    return false;
+  }
+  const auto symbol = GetSymbol(c);
+  // a function of another type shadows the old one instead, as without
+  // trampolines
+  CXString canonical_str =
+      clang_getTypeSpelling(clang_getCanonicalType(clang_getCursorType(c)));
+  auto slot = trampolines_->GetSlot(symbol, clang_getCString(canonical_str));
+  clang_disposeString(canonical_str);
+  if (!slot) {
+    return false;
+  }
+  const auto slot_name = "__rcrl_fn_" + std::to_string(
+                                            reinterpret_cast<uintptr_t>(slot));
+  Trampoline trampoline;
+  if (!trampolines_->IsDefined(symbol)) {
+    // the exported function forwards to whatever body the slot points to,
+    // later plugins only declare it
+    string params, args;
+    for (auto i = 0, n = clang_Cursor_getNumArguments(c); i < n; ++i) {
+      auto arg = clang_Cursor_getArgument(c, i);
+      CXString arg_type_str = clang_getTypeSpelling(clang_getCursorType(arg));
+      CXString arg_name_str = clang_getCursorSpelling(arg);
+      const string arg_type =
+          "__rcrl_type<" + string(clang_getCString(arg_type_str)) + ">";
+      string arg_name = clang_getCString(arg_name_str);
+      clang_disposeString(arg_type_str);
+      clang_disposeString(arg_name_str);
+      string default_value;
+      if (arg_name.empty()) {
+        arg_name = "__rcrl_arg" + std::to_string(i);
+      } else {
+        clang_getExpansionLocation(clang_getCursorLocation(arg), nullptr,
+                                   &line, &column, nullptr);
+        unsigned int end_line, end_column;
+        clang_getExpansionLocation(
+            clang_getRangeEnd(clang_getCursorExtent(arg)), nullptr, &end_line,
+            &end_column, nullptr);
+        default_value = string(GetRange(
+            {line, column + static_cast<unsigned int>(arg_name.size())},
+            {end_line, end_column}));
+        default_value.erase(0, default_value.find_first_not_of(" \t\n"));
+        if (default_value.empty() || default_value[0] != '=') {
+          default_value.clear();
+        } else {
+          default_value = " " + default_value;
+        }
+      }
+      params += (i ? ", " : "") + arg_type + " " + arg_name + default_value;
+      args += (i ? ", " : "") + string("static_cast<") + arg_type + "&&>(" +
+              arg_name + ")";
+    }
+    trampoline.dispatcher =
+        "using " + slot_name + "_t = " + type + ";\n" +
+        __STR(RCRL_EXPORT_API) + " __rcrl_type<" + result + "> " + name +
+        "(" + params +
+        ") {\n  return reinterpret_cast<" + slot_name +
+        "_t*>(__atomic_load_n(reinterpret_cast<void**>(" +
+        ToAddress(slot) + "), __ATOMIC_ACQUIRE))(" + args + ");\n}\n";
+  }
+  // a redefinition adds a body of its own, the last store wins
+  const auto body = slot_name + "_" + std::to_string(code_gen_number_);
+  trampoline.definition =
+      "static " + head + body + string(GetRange(after_name, code.end_pos)) +
+      "\nstatic const int " + body +
+      "_patched = (__atomic_store_n(reinterpret_cast<void**>(" +
+      ToAddress(slot) + "), reinterpret_cast<void*>(&" + body +
+      "), __ATOMIC_RELEASE), 0)";
+  AppendValidCodeBlock(source_output_, code,
+                       trampoline.dispatcher + trampoline.definition);
+  trampoline_code_[symbol] = std::move(trampoline);
+  return true;
+}
 void PluginParser::set_flags(std::vector<string> f) {
   flags_ = f;
   UpdateAstWithOtherFlags();
 }
 
-string PluginParser::ReadToOneOfCharacters(Point start, string chars) {
-  auto i = start.line - 1;
-  auto j = start.column - 1;
-  auto n = file_content_.size();
-  auto result = string("");
-  auto line = file_content_[i].substr(j);
-  bool not_found = true;
-  for (; not_found && i < n; j = 0, i++) {
-    if (j == 0) {
-      line = file_content_[i];
-    } else {
-      j = 0;
-    }
-    do {
-      not_found = (chars.find(line[j++]) == chars.npos);
-    } while (not_found && j < line.size());
-    result += not_found && j > 0 ? line : line.substr(0, j - 1);
+size_t PluginParser::GetOffset(Point p) {
+  if (p.line > line_offsets_.size()) {
+    return source_.size();
   }
-  return result;
+  return std::min(line_offsets_[p.line - 1] + p.column - 1, source_.size());
+}
+std::string_view PluginParser::GetLine(unsigned int line) {
+  return GetRange({line, 1}, {line + 1, 1});
+}
+std::string_view PluginParser::ReadToOneOfCharacters(Point start,
+                                                     const char* chars) {
+  auto begin = GetOffset(start);
+  auto end = std::min(source_.find_first_of(chars, begin), source_.size());
+  return std::string_view(source_).substr(begin, end - begin);
 }
 // end point shouldn't be taken
-void PluginParser::AppendRange(Point start, Point end) {
-  if (start < end) {
-    if (start.line == end.line) {
-      generated_file_content_.append(file_content_[start.line - 1].substr(
-          start.column - 1, end.column - start.column));
-    } else {
-      while (start.line < end.line) {
-        generated_file_content_.append(file_content_[start.line - 1]);
-        start.line++;
-      }
-      generated_file_content_.append(
-          file_content_[end.line - 1].substr(0, end.column - 1));
-    }
+std::string_view PluginParser::GetRange(Point start, Point end) {
+  if (!(start < end)) {
+    return std::string_view();
   }
+  auto begin = GetOffset(start);
+  return std::string_view(source_).substr(begin, GetOffset(end) - begin);
+}
+void PluginParser::AppendRange(Output& out, Point start, Point end) {
+  out.Append(GetRange(start, end), start.line);
 }
 
-void PluginParser::AppendValidCodeBlockWithoutNamespace(CodeBlock code) {
-  switch (clang_getCursorKind(code.cursor)) {
-    case CXCursor_Namespace: {
-      auto str = ReadToOneOfCharacters(code.start_pos, "{") + "{\n";
-      name_space_end_.emplace_back(
-          std::make_tuple(code.start_pos, code.end_pos, str));
-      break;
-    }
-    default: {
-      // global and variable declarations
-      AppendRange(code.start_pos, code.end_pos);
-      break;
-    }
+void PluginParser::AppendValidCodeBlock(Output& out, const CodeBlock& code,
+                                        std::string_view text,
+                                        std::string_view prefix) {
+  // reopen the namespaces around the block that aren't open yet
+  for (; out.open_namespaces < namespaces_.size(); ++out.open_namespaces) {
+    const auto& name_space = namespaces_[out.open_namespaces];
+    out.Append(name_space.head, name_space.start.line);
+  }
+  const bool in_session = IsInSession(code);
+  if (in_session) {
+    out.Append("inline namespace " + session_ + " {\n");
+  }
+  out.Append(prefix);
+  if (text.empty()) {
+    AppendRange(out, code.start_pos, code.end_pos);
+  } else {
+    out.Append(text, code.start_pos.line);
   }
   if (clang_getCursorKind(code.cursor) != CXCursor_InclusionDirective &&
       clang_getCursorKind(code.cursor) != CXCursor_MacroDefinition) {
-    generated_file_content_.append(";\n");
+    out.Append(";\n");
   } else {
-    generated_file_content_.append("\n");
+    out.Append("\n");
+  }
+  if (in_session) {
+    out.Append("}\n");
+  }
+}
+
+void PluginParser::CloseNamespaces(Output& out, size_t depth) {
+  for (; out.open_namespaces > depth; --out.open_namespaces) {
+    out.Append("}\n");
   }
 }
 
-void PluginParser::AppendValidCodeBlock(CodeBlock code) {
-  int i = 0;
-  for (const auto& [start, end, str] : name_space_end_) {
-    if (start < code.start_pos && code.end_pos < end) {
-      generated_file_content_.append(str);
-      i++;
+void PluginParser::ForEachCodeBlock(
+    std::initializer_list<Output*> outputs,
+    const std::function<void(const CodeBlock&)>& emit) {
+  // the blocks are sorted, so the namespaces around a block are a stack
+  namespaces_.clear();
+  for (const auto& code : code_blocks_) {
+    while (!namespaces_.empty() && !(code.start_pos < namespaces_.back().end)) {
+      namespaces_.pop_back();
+      for (auto out : outputs) {
+        CloseNamespaces(*out, namespaces_.size());
+      }
+    }
+    if (clang_getCursorKind(code.cursor) == CXCursor_Namespace) {
+      // opened in an output once something is written into it
+      namespaces_.push_back(
+          {code.start_pos, code.end_pos,
+           string(ReadToOneOfCharacters(code.start_pos, "{")) + "{\n"});
+      continue;
     }
+    emit(code);
   }
-  AppendValidCodeBlockWithoutNamespace(code);
-  for (int j = 0; j < i; ++j) {
-    generated_file_content_.append("}\n");
+  namespaces_.clear();
+  for (auto out : outputs) {
+    CloseNamespaces(*out, 0);
   }
 }
 
-void PluginParser::AppendOnceCodeBlocks() {
-  std::sort(code_blocks_.begin(), code_blocks_.end(),
-            [](const CodeBlock& a, const CodeBlock& b) {
-              return a.start_pos < b.start_pos;
-            });
+void PluginParser::AppendOnceCodeBlocks(Output& out) {
   Point p = {1, 1};
-  auto line = p.line;
-  auto column = p.column;
   // append every unparsed piece of text to once function.
-  for (auto c : code_blocks_) {
-    while (line < c.start_pos.line) {
-      generated_file_content_.append(
-          file_content_[line - 1].substr(column - 1));
-      line++;
-      column = 1;
+  for (const auto& c : code_blocks_) {
+    // members of a namespace were skipped with it
+    if (c.start_pos < p) {
+      continue;
     }
-    generated_file_content_.append(file_content_[line - 1].substr(
-        column - 1, c.start_pos.column - column));
-    if (clang_getCursorKind(c.cursor) != CXCursor_Namespace) {
-      line = c.end_pos.line;
-      column = c.end_pos.column;
-    } else {
-      // skip to '{'
-      auto namespace_begin = ReadToOneOfCharacters(c.start_pos, "{") + "{";
-      line += std::count(namespace_begin.begin(), namespace_begin.end(), '\n');
-      column = file_content_[line].find("{") + 1;
-      generated_file_content_.append(namespace_begin + "\n");
-      // closing '}' will be appended by the above procedure
+    out.Append(GetRange(p, c.start_pos), p.line);
+    p = c.end_pos;
+  }
+  out.Append(std::string_view(source_).substr(GetOffset(p)), p.line);
+}
+
+bool PluginParser::HasOnceCode(unsigned int first_line) {
+  std::stable_sort(code_blocks_.begin(), code_blocks_.end(),
+                   [](const CodeBlock& a, const CodeBlock& b) {
+                     return a.start_pos < b.start_pos;
+                   });
+  // the text AppendOnceCodeBlocks would append
+  Point p = {first_line, 1};
+  for (const auto& c : code_blocks_) {
+    // members of a namespace, or a block before first_line
+    if (c.start_pos < p) {
+      p = std::max(p, c.end_pos);
+      continue;
     }
+    if (HasCode(GetRange(p, c.start_pos))) {
+      return true;
+    }
+    p = c.end_pos;
+  }
+  return HasCode(std::string_view(source_).substr(GetOffset(p)));
+}
+
+bool PluginParser::HasGlobalCode(unsigned int first_line) {
+  return std::any_of(code_blocks_.begin(), code_blocks_.end(),
+                     [&](const CodeBlock& c) {
+                       return c.start_pos.line >= first_line &&
+                              !IsHeaderInclude(c);
+                     });
+}
+
+void PluginParser::AppendDeclaration(Output& out, const CodeBlock& code,
+                                     unsigned int number) {
+  auto c = code.cursor;
+  auto gen_sym = "_" + std::to_string(number) + "_t";
+  // reused, so its capacity is kept across declarations
+  auto& declaration = declaration_;
+  auto AppendString = [&](CXString str) {
+    declaration += clang_getCString(str);
+    clang_disposeString(str);
+  };
+  // using x = type;
+  declaration.assign("using ").append(gen_sym).append(" = ");
+  if (clang_getCursorKind(c) == CXCursor_VarDecl) {
+    AppendString(clang_getTypeSpelling(clang_getCursorType(c)));
+  } else {
+    if (clang_getCursorKind(c) != CXCursor_FunctionDecl) {
+      assert(false);
+    }
+    AppendString(
+        clang_getTypeSpelling(clang_getResultType(clang_getCursorType(c))));
+  }
+  declaration += ";\n";
+  if (clang_getCursorKind(c) == CXCursor_VarDecl && GetArenaSlot(c)) {
+    CXString name = clang_getCursorSpelling(c);
+    declaration += ArenaReference(gen_sym, clang_getCString(name),
+                                  GetArenaSlot(c));
+    clang_disposeString(name);
+    AppendValidCodeBlock(out, code, declaration);
+    return;
   }
-  while (line < file_content_.size()) {
-    generated_file_content_.append(file_content_[line - 1].substr(column - 1));
-    line++;
-    column = 1;
+  // extern x name
+  declaration.append(RCRL_IMPORT_API " extern ").append(gen_sym).append(" ");
+  AppendString(clang_getCursorSpelling(c));
+  if (clang_getCursorKind(c) == CXCursor_FunctionDecl) {
+    // extern x f_name(arg1 , arg2, ...)
+    declaration += "(";
+    for (auto i = 0, n = clang_Cursor_getNumArguments(c); i < n; ++i) {
+      if (i > 0) {
+        declaration += ", ";
+      }
+      auto c_arg = clang_Cursor_getArgument(c, i);
+      unsigned int lin, col;
+      c_arg = clang_getCursorDefinition(c_arg);
+      clang_getExpansionLocation(
+          clang_getRangeStart(clang_getCursorExtent(c_arg)), nullptr, &lin,
+          &col, nullptr);
+      Point start = {lin, col};
+      clang_getExpansionLocation(
+          clang_getRangeEnd(clang_getCursorExtent(c_arg)), nullptr, &lin, &col,
+          nullptr);
+      Point end = {lin, col};
+      declaration += GetRange(start, end);
+    }
+    if (clang_Cursor_isVariadic(c)) {
+      declaration += "...";
+    }
+    declaration += ")";
   }
-  generated_file_content_.append(file_content_[line - 1].substr(column - 1));
+  AppendValidCodeBlock(out, code, declaration);
+}
+
+bool PluginParser::IsHeaderInclude(const CodeBlock& code) {
+  return clang_getCursorKind(code.cursor) == CXCursor_InclusionDirective &&
+         GetLine(code.start_pos.line).find("#include \"plugin.hpp\"") !=
+             std::string::npos;
 }
 
 void PluginParser::GenerateSourceFile(string file_name, string prepend_str,
                                       string append_str) {
-  std::vector<unsigned int> lines;
-  generated_file_content_ = "";
-  generated_file_content_ += prepend_str;
-  for (const auto& code : code_blocks_) {
+  TraceScope trace("GenerateSourceFile");
+  // the once block and the exported definitions are the code again, plus
+  // what is generated around them
+  source_output_.Reset(prepend_str.size() + append_str.size() +
+                           2 * source_.size() + 256,
+                       2 * line_offsets_.size());
+  header_output_.Reset(source_.size() + 256, line_offsets_.size());
+  arena_slots_.clear();
+  trampoline_code_.clear();
+  std::stable_sort(code_blocks_.begin(), code_blocks_.end(),
+                   [](const CodeBlock& a, const CodeBlock& b) {
+                     return a.start_pos < b.start_pos;
+                   });
+  const auto once_number = code_gen_number_;
+  // the header is only written after a successful compile, its aliases are
+  // numbered after the once block
+  auto alias_number = once_number + 1;
+  source_output_.Append(prepend_str);
+  if (arena_) {
+    // placement new
+    source_output_.Append("#include <new>\n");
+  }
+  auto generate = [&](const CodeBlock& code) {
     switch (clang_getCursorKind(code.cursor)) {
       case CXCursor_MacroDefinition:
-      case CXCursor_Namespace:
       case CXCursor_FunctionTemplate:
       case CXCursor_InclusionDirective:
       case CXCursor_UsingDirective:
@@ -303,7 +957,10 @@ void PluginParser::GenerateSourceFile(string file_name, string prepend_str,
       case CXCursor_ClassDecl:
       case CXCursor_NamespaceAlias:
       case CXCursor_OverloadedDeclRef: {
-        AppendValidCodeBlock(code);
+        AppendValidCodeBlock(source_output_, code);
+        if (!IsHeaderInclude(code)) {
+          AppendValidCodeBlock(header_output_, code);
+        }
         break;
       }
       default: {
@@ -312,114 +969,156 @@ void PluginParser::GenerateSourceFile(string file_name, string prepend_str,
             clang_getCursorKind(code.cursor) != CXCursor_VarDecl) {
           assert(false);
         }
-        generated_file_content_ += __STR(RCRL_EXPORT_API) + string(" ");
-        AppendValidCodeBlock(code);
+        if (!(arena_ &&
+              clang_getCursorKind(code.cursor) == CXCursor_VarDecl &&
+              AppendArenaVariable(code)) &&
+            !(trampolines_ &&
+              clang_getCursorKind(code.cursor) == CXCursor_FunctionDecl &&
+              AppendTrampolineFunction(code))) {
+          // exported inside the namespaces around it
+          AppendValidCodeBlock(source_output_, code, {},
+                               __STR(RCRL_EXPORT_API) " ");
+        }
+        AppendDeclaration(header_output_, code, alias_number++);
         break;
       }
     }
+  };
+  ForEachCodeBlock({&source_output_, &header_output_}, generate);
+  source_output_.Append("\nint __rcrl_internal_once_" +
+                        std::to_string(once_number) + " = [](){\n");
+  AppendOnceCodeBlocks(source_output_);
+  source_output_.Append("  return 0;}();\n");
+  source_output_.Append(append_str);
+  code_gen_number_ = alias_number;
+  if (!file_name.empty()) {
+    std::ofstream file(file_name, std::fstream::out | std::fstream::trunc);
+    file << source_output_.text;
   }
-  generated_file_content_ += "\nint __rcrl_internal_once_" +
-                             std::to_string(code_gen_number_++) + " = [](){\n";
-  AppendOnceCodeBlocks();
-  generated_file_content_ += "  return 0;}();\n";
-  generated_file_content_ += append_str;
-  std::ofstream file(file_name, std::fstream::out | std::fstream::trunc);
-  file << generated_file_content_;
 }
 
 void PluginParser::GenerateHeaderFile(string file_name) {
-  generated_file_content_ = "";
-  for (const auto& code : code_blocks_) {
+  TraceScope trace("GenerateHeaderFile");
+  // the plugin that defines the dispatchers is about to be loaded
+  for (const auto& [symbol, trampoline] : trampoline_code_) {
+    if (!trampoline.dispatcher.empty()) {
+      trampolines_->SetDefined(symbol);
+    }
+  }
+  std::ofstream file(file_name, std::fstream::out | std::fstream::app);
+  file << header_output_.text;
+}
+
+void PluginParser::GenerateCompactionSource(
+    std::vector<CompactionDefinition>& definitions,
+    std::vector<string>& variables, string& error) {
+  auto generate = [&](const CodeBlock& code) {
+    // every block reopens the namespaces around it, so a declaration can
+    // stand in for it on its own
+    CompactionDefinition definition;
+    Output out;
     switch (clang_getCursorKind(code.cursor)) {
-      case CXCursor_Namespace: {
+      case CXCursor_InclusionDirective: {
+        if (IsHeaderInclude(code)) {
+          return;
+        }
+        AppendValidCodeBlock(out, code);
         break;
       }
-      case CXCursor_InclusionDirective: {
-        if (file_content_[code.start_pos.line - 1].find(
-                "#include \"plugin.hpp\"") != std::string::npos) {
+      case CXCursor_VarDecl: {
+        // arena variables stay where they are
+        if (auto slot = GetArenaSlot(code.cursor)) {
+          CXString type =
+              clang_getTypeSpelling(clang_getCursorType(code.cursor));
+          CXString name = clang_getCursorSpelling(code.cursor);
+          const auto alias = ArenaType(slot);
+          AppendValidCodeBlock(
+              out, code,
+              "using " + alias + " = " + clang_getCString(type) + ";\n" +
+                  ArenaReference(alias, clang_getCString(name), slot));
+          clang_disposeString(type);
+          clang_disposeString(name);
+          break;
+        }
+        CXString type = clang_getTypeSpelling(clang_getCursorType(code.cursor));
+        CXString name = clang_getCursorSpelling(code.cursor);
+        // internal ones aren't exported, so they would start over. That is
+        // only the same for constants
+        if (clang_getCursorLinkage(code.cursor) != CXLinkage_External) {
+          if (!clang_isConstQualifiedType(clang_getCursorType(code.cursor)) &&
+              error.empty()) {
+            error = string(clang_getCString(name)) +
+                    " has internal linkage, it would start over";
+          }
+          clang_disposeString(type);
+          clang_disposeString(name);
+          AppendValidCodeBlock(out, code, {}, __STR(RCRL_EXPORT_API) " ");
           break;
         }
+        // a vptr, or the function pointers of a std::function or of the
+        // control block of a shared_ptr, would still point into the
+        // unloaded plugins. So would any pointer or reference, e.g. to a
+        // string literal, the bytes are copied as they are
+        if (!clang_isPODType(clang_getCursorType(code.cursor)) &&
+            error.empty()) {
+          error = string(clang_getCString(name)) + " of type " +
+                  clang_getCString(type) +
+                  " isn't a POD type, moving it may keep pointers into the "
+                  "unloaded plugins";
+        }
+        if (HoldsAddress(clang_getCursorType(code.cursor)) && error.empty()) {
+          error = string(clang_getCString(name)) + " of type " +
+                  clang_getCString(type) +
+                  " holds an address, it may point into the unloaded plugins";
+        }
+        definition.symbol = GetSymbol(code.cursor);
+        auto symbol = definition.symbol;
+        if (IsInSession(code)) {
+          symbol = GetSessionSymbol(session_, symbol, clang_getCString(name));
+        }
+        // the alias keeps arrays and function pointers in one piece
+        string text = __STR(RCRL_EXPORT_API) + string(" __rcrl_type<") +
+                      clang_getCString(type) + "> " + clang_getCString(name) +
+                      " = __rcrl_relocate<__rcrl_type<" +
+                      clang_getCString(type) + ">>(\"" + symbol + "\")";
+        variables.push_back(symbol);
+        clang_disposeString(type);
+        clang_disposeString(name);
+        AppendValidCodeBlock(out, code, text);
+        break;
       }
-      case CXCursor_MacroDefinition:
-      case CXCursor_FunctionTemplate:
-      case CXCursor_NamespaceAlias:
-      case CXCursor_UsingDirective:
-      case CXCursor_EnumConstantDecl:
-      case CXCursor_TypeAliasTemplateDecl:
-      case CXCursor_TypedefDecl:
-      case CXCursor_ClassTemplate:
-      case CXCursor_ClassTemplatePartialSpecialization:
-      case CXCursor_StructDecl:
-      case CXCursor_TypeAliasDecl:
-      case CXCursor_UnionDecl:
-      case CXCursor_UsingDeclaration:
-      case CXCursor_EnumDecl:
-      case CXCursor_ClassDecl:
-      case CXCursor_OverloadedDeclRef: {
-        AppendValidCodeBlock(code);
+      case CXCursor_FunctionDecl: {
+        auto trampoline = trampoline_code_.find(GetSymbol(code.cursor));
+        if (trampoline != trampoline_code_.end()) {
+          AppendValidCodeBlock(out, code,
+                               trampoline->second.dispatcher +
+                                   trampoline->second.definition);
+          break;
+        }
+        // a static one can't be declared extern
+        if (clang_getCursorLinkage(code.cursor) == CXLinkage_External) {
+          definition.symbol = GetSymbol(code.cursor);
+        }
+        // exported inside the namespaces around it
+        AppendValidCodeBlock(out, code, {}, __STR(RCRL_EXPORT_API) " ");
         break;
       }
       default: {
-        CXString c_str;
-        auto c = code.cursor;
-        auto gen_sym = "_" + std::to_string(code_gen_number_++) + "_t";
-        if (clang_getCursorKind(c) == CXCursor_VarDecl) {
-          c_str = clang_getTypeSpelling((clang_getCursorType(c)));
-          generated_file_content_ += string("using ") + gen_sym +
-                                     string(" = ") + clang_getCString(c_str) +
-                                     string(";\n" RCRL_IMPORT_API " extern ") +
-                                     gen_sym + " ";
-          clang_disposeString(c_str);
-          c_str = clang_getCursorSpelling(c);
-          generated_file_content_ += clang_getCString(c_str);
-        } else {
-          if (clang_getCursorKind(code.cursor) != CXCursor_FunctionDecl) {
-            assert(false);
-          }
-          // func decl
-          // using x = return_type;
-          // extern return_type ...
-          c_str = clang_getTypeSpelling(
-              clang_getResultType(clang_getCursorType(c)));
-          generated_file_content_ += string("using ") + gen_sym +
-                                     string(" = ") + clang_getCString(c_str) +
-                                     string(";\n" RCRL_IMPORT_API " extern ") +
-                                     gen_sym + " ";
-          clang_disposeString(c_str);
-          // extern return_type f_name(...
-          c_str = clang_getCursorSpelling(c);
-          generated_file_content_ += clang_getCString(c_str) + string("(");
-          // extern return_type f_name(arg1 , arg2, ...)
-          for (auto i = 0, n = clang_Cursor_getNumArguments(c); i < n; ++i) {
-            if (i > 0) {
-              generated_file_content_ += ", ";
-            }
-            auto c_arg = clang_Cursor_getArgument(c, i);
-            unsigned int lin, col;
-            c_arg = clang_getCursorDefinition(c_arg);
-            clang_getExpansionLocation(
-                clang_getRangeStart(clang_getCursorExtent(c_arg)), nullptr,
-                &lin, &col, nullptr);
-            Point start = {lin, col};
-            clang_getExpansionLocation(
-                clang_getRangeEnd(clang_getCursorExtent(c_arg)), nullptr, &lin,
-                &col, nullptr);
-            Point end = {lin, col};
-            AppendRange(start, end);
-          }
-          if (clang_Cursor_isVariadic(c)) {
-            generated_file_content_ += "...";
-          }
-          generated_file_content_ += ")";
-        }
-        clang_disposeString(c_str);
-        generated_file_content_ += ";\n";
+        AppendValidCodeBlock(out, code);
         break;
       }
     }
-  }
-  std::ofstream file(file_name, std::fstream::out | std::fstream::app);
-  file << generated_file_content_;
+    CloseNamespaces(out, 0);
+    definition.definition = std::move(out.text);
+    if (!definition.symbol.empty()) {
+      Output declaration;
+      AppendDeclaration(declaration, code, compaction_number_++);
+      CloseNamespaces(declaration, 0);
+      definition.declaration = std::move(declaration.text);
+    }
+    definitions.push_back(std::move(definition));
+  };
+  ForEachCodeBlock({}, generate);
 }
 
 }  // namespace rcrl
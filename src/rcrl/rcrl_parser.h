@@ -4,12 +4,22 @@
 
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <initializer_list>
 #include <iostream>
+#include <list>
+#include <map>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <tuple>
 #include <vector>
 
+#include "rcrl_arena.h"
+#include "rcrl_diagnostics.h"
+#include "rcrl_parse_service.h"
+#include "rcrl_trampoline.h"
+
 namespace fs = std::filesystem;
 
 namespace rcrl {
@@ -26,38 +36,185 @@ struct CodeBlock {
   CXCursor cursor;  // for any additional info.
 };
 
+// a block of GenerateCompactionSource, in the namespaces around it
+struct CompactionDefinition {
+  string symbol;  // of a redefinable variable or function, empty otherwise
+  string definition;
+  // extern declaration in its place when a later definition replaces it
+  string declaration;
+};
+
+// a translation unit kept for a set of flags
+struct UnitStats {
+  string flags;  // normalized: trimmed, one per line, without blanks
+  size_t memory_bytes = 0;  // as reported by clang_getCXTUResourceUsage
+  bool current = false;     // parsed with the flags in use
+};
+
 class PluginParser {
  public:
   PluginParser(fs::path file,
                std::vector<string> command_line_args = std::vector<string>(0));
   ~PluginParser();
   void Reparse();
+  // parses contents as if it were the file, without reading or writing it
+  void Reparse(string contents);
+  // the source is only kept in get_generated_source when file_name is empty
   void GenerateSourceFile(string file_name, string prepend_str = "",
                           string append_str = "");
+  // appends the declarations GenerateSourceFile found in the same pass
   void GenerateHeaderFile(string file_name);
+  // appends the definitions of the last parse without the once block, for
+  // merging many submissions into one library. Variables are initialized by
+  // moving from __rcrl_relocate<T>("symbol"), which the merged source has to
+  // provide, their symbols are added to variables. error tells why when a
+  // variable can't be moved out of its plugin, e.g. a polymorphic object or
+  // a static one
+  void GenerateCompactionSource(std::vector<CompactionDefinition>& definitions,
+                                std::vector<string>& variables, string& error);
+  // output of the last GenerateSourceFile call
+  const string& get_generated_source();
+  // line of the parsed file that ended up on the given line of the last
+  // generated output, 0 for generated code, both 1 based
+  unsigned int GetSourceLine(unsigned int generated_line);
+  // errors of the last parse that clang++ is bound to report too: the ones
+  // inside declarations, which are copied verbatim, and fatal ones. Errors of
+  // top level statements are expected, they only compile once wrapped
+  std::vector<Diagnostic> GetHardErrors();
+  // whether the last parse has code for the once block from first_line on,
+  // i.e. statements that run after every global of the plugin is
+  // initialized. Comments and stray semicolons don't count
+  bool HasOnceCode(unsigned int first_line = 1);
+  // whether the last parse has code that goes before the once block from
+  // first_line on: definitions, includes or macros, other than the include
+  // of plugin.hpp
+  bool HasGlobalCode(unsigned int first_line = 1);
+  // numbering of the generated symbols, restored after speculative compiles
+  unsigned int get_code_gen_number();
+  void set_code_gen_number(unsigned int number);
+  // variables and functions defined in the namespaces of the code go in an
+  // inline namespace of this name, so the symbols of two sessions in one
+  // process don't bind to each other. Empty leaves them as they are
+  void set_session(string name);
+  // exported variables are constructed in arena slots, nullptr turns it off.
+  // Every plugin reaches them through a static reference to the slot
+  void set_arena(VariableArena* arena);
+  // exported functions are called through the slots of the table, nullptr
+  // turns it off. Functions marked RCRL_DIRECT are called directly
+  void set_trampolines(TrampolineTable* trampolines);
+  // parses on the workers of the service, with its index and the preludes it
+  // precompiles for all parsers, nullptr parses on the calling thread. The
+  // units parsed so far are dropped
+  void set_service(ParseService* service);
+  // text of the header that the parsed file includes first, with a service
+  // it is precompiled once for every parser using the same text and flags
+  void set_prelude(string text);
   fs::path get_file();
   std::vector<string> get_flags();
-  // runs UpdateAstWithOtherFlags internally
+  // runs UpdateAstWithOtherFlags internally, switching to flags that have a
+  // unit in the cache is instant
   void set_flags(std::vector<string> new_flags);
+  bool HasUnit(const std::vector<string>& flags);
+  // units kept for recently used flags, the least recently used is disposed
+  void set_max_units(size_t units);
+  // most recently used first
+  std::vector<UnitStats> GetUnitStats();
 
  private:
   void Parse();
+  // loads the file into source_ and indexes its lines
+  void ReadFile();
+  void IndexLines();
+  // source_ under the name of the file, for libclang
+  CXUnsavedFile GetUnsavedFile();
+  void ReparseSource();
   void UpdateAstWithOtherFlags();
-  string ConsumeToLine(unsigned int line);
-  string ReadToOneOfCharacters(Point start, string chars);
-  void AppendRange(Point start, Point end);
-  void AppendValidCodeBlockWithoutNamespace(CodeBlock code);
-  void AppendValidCodeBlock(CodeBlock code);
-  void AppendOnceCodeBlocks();
-
-  string generated_file_content_;
-  std::vector<string> file_content_;
+  // on a worker of the service if there is one
+  void RunParse(const std::function<void()>& parse);
+  CXTranslationUnit ParseUnit();
+  // disposes every unit and parses the current flags again
+  void ResetUnits();
+  // the unit of the current flags
+  CXTranslationUnit GetUnit();
+  void DisposeUnit(CXTranslationUnit unit);
+  // down to max_units_ and, with a service, to its memory budget
+  void EvictUnits();
+  size_t GetUnitMemory(CXTranslationUnit unit);
+  // the views below point into source_ and are valid until the next parse
+  size_t GetOffset(Point p);
+  std::string_view GetLine(unsigned int line);
+  std::string_view ReadToOneOfCharacters(Point start, const char* chars);
+  struct Output {
+    string text;
+    std::vector<unsigned int> line_map = {0};  // source line per text line
+    size_t open_namespaces = 0;  // leading entries of namespaces_ in text
+    // source_line is where str starts in the parsed file, 0 if generated
+    void Append(std::string_view str, unsigned int source_line = 0);
+    // empties the output, reserving room for what will be generated
+    void Reset(size_t expected_size, size_t expected_lines);
+  };
+  std::string_view GetRange(Point start, Point end);
+  void AppendRange(Output& out, Point start, Point end);
+  // text replaces the code of the block when not empty, prefix goes before
+  // it, both inside the namespaces around the block
+  void AppendValidCodeBlock(Output& out, const CodeBlock& code,
+                            std::string_view text = {},
+                            std::string_view prefix = {});
+  void CloseNamespaces(Output& out, size_t depth);
+  // calls emit for every block but namespaces in source order, closing the
+  // namespaces in the outputs as the blocks leave them
+  void ForEachCodeBlock(std::initializer_list<Output*> outputs,
+                        const std::function<void(const CodeBlock&)>& emit);
+  void AppendOnceCodeBlocks(Output& out);
+  // extern declaration of a variable or function, using alias _number_t
+  void AppendDeclaration(Output& out, const CodeBlock& code,
+                         unsigned int number);
+  bool IsHeaderInclude(const CodeBlock& code);
+  // whether AppendValidCodeBlock wraps the block in the session namespace
+  bool IsInSession(const CodeBlock& code);
+  // false when the variable can't live in the arena, e.g. arrays or types
+  // that aren't POD or hold pointers
+  bool AppendArenaVariable(CodeBlock code);
+  // slot the last generated source gave the variable, nullptr if none
+  void* GetArenaSlot(CXCursor c);
+  // false when the function is called directly
+  bool AppendTrampolineFunction(CodeBlock code);
+
+  Output source_output_;
+  Output header_output_;
+  string declaration_;  // scratch buffer of AppendDeclaration
+  string source_;  // the parsed file
+  std::vector<size_t> line_offsets_;  // where each line of source_ starts
   std::vector<CodeBlock> code_blocks_;
   std::vector<string> flags_;
-  std::vector<std::tuple<Point, Point, string>> name_space_end_;
-  std::tuple<CXIndex, CXTranslationUnit> ast_;
+  struct Namespace {
+    Point start;
+    Point end;
+    string head;  // up to and including the '{'
+  };
+  // enclosing the current block while generating, outermost first
+  std::vector<Namespace> namespaces_;
+  CXIndex index_;
+  struct Unit {
+    string flags;  // normalized
+    CXTranslationUnit unit;
+  };
+  std::list<Unit> units_;  // most recently used first
+  size_t max_units_ = 4;
+  ParseService* service_ = nullptr;
+  string prelude_;
   const fs::path file_path_;
   unsigned int code_gen_number_;
+  VariableArena* arena_ = nullptr;
+  std::map<string, void*> arena_slots_;  // by symbol
+  string session_;
+  unsigned int compaction_number_ = 0;  // of the aliases of the declarations
+  TrampolineTable* trampolines_ = nullptr;
+  struct Trampoline {
+    string dispatcher;  // empty when a loaded plugin defines it
+    string definition;  // renamed body and the store to the slot
+  };
+  std::map<string, Trampoline> trampoline_code_;  // by symbol
 };
 
 }  // namespace rcrl
@@ -0,0 +1,86 @@
+#include "rcrl_scheduler.h"
+
+namespace rcrl {
+
+CompileScheduler::CompileScheduler(size_t workers)
+    : max_concurrency_(workers) {
+  for (size_t i = 0; i < workers; ++i) {
+    workers_.emplace_back(&CompileScheduler::Work, this);
+  }
+}
+
+CompileScheduler::~CompileScheduler() {
+  {
+    std::lock_guard<std::mutex> lock(mut_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+std::future<int> CompileScheduler::Submit(const string& session,
+                                          std::function<int()> task) {
+  std::packaged_task<int()> packaged(std::move(task));
+  auto future = packaged.get_future();
+  {
+    std::lock_guard<std::mutex> lock(mut_);
+    auto& queue = queues_[session];
+    if (queue.empty()) {
+      round_robin_.push_back(session);
+    }
+    queue.push_back(std::move(packaged));
+    queued_++;
+  }
+  cv_.notify_one();
+  return future;
+}
+
+void CompileScheduler::set_max_concurrency(size_t limit) {
+  {
+    std::lock_guard<std::mutex> lock(mut_);
+    max_concurrency_ = limit ? std::min(limit, workers_.size())
+                             : workers_.size();
+  }
+  cv_.notify_all();
+}
+
+size_t CompileScheduler::get_queued() {
+  std::lock_guard<std::mutex> lock(mut_);
+  return queued_;
+}
+
+void CompileScheduler::Work() {
+  std::unique_lock<std::mutex> lock(mut_);
+  while (true) {
+    cv_.wait(lock, [&]() {
+      return (queued_ && running_ < max_concurrency_) || (stop_ && !queued_);
+    });
+    if (!queued_) {
+      return;
+    }
+    // take one task of the next session and send it to the back of the line
+    const auto session = round_robin_.front();
+    round_robin_.pop_front();
+    auto& queue = queues_[session];
+    auto task = std::move(queue.front());
+    queue.pop_front();
+    if (queue.empty()) {
+      queues_.erase(session);
+    } else {
+      round_robin_.push_back(session);
+    }
+    queued_--;
+    running_++;
+
+    lock.unlock();
+    task();
+    lock.lock();
+
+    running_--;
+    cv_.notify_one();
+  }
+}
+
+}  // namespace rcrl
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace rcrl {
+using std::string;
+
+// Fixed pool of compile workers shared by many sessions. Every session has
+// its own queue and the queues are served round robin, so one session
+// submitting a burst of compiles can't starve the others.
+class CompileScheduler {
+ public:
+  explicit CompileScheduler(
+      size_t workers = std::max(1u, std::thread::hardware_concurrency()));
+  // runs the tasks that are still queued before returning
+  ~CompileScheduler();
+  std::future<int> Submit(const string& session, std::function<int()> task);
+  // at most limit tasks run at once, 0 means one per worker
+  void set_max_concurrency(size_t limit);
+  size_t get_queued();
+
+ private:
+  void Work();
+
+  std::mutex mut_;
+  std::condition_variable cv_;
+  std::map<string, std::deque<std::packaged_task<int()>>> queues_;
+  std::list<string> round_robin_;  // sessions with queued tasks
+  size_t queued_ = 0;
+  size_t running_ = 0;
+  size_t max_concurrency_;
+  bool stop_ = false;
+  std::vector<std::thread> workers_;
+};
+
+}  // namespace rcrl
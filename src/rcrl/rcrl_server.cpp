@@ -0,0 +1,155 @@
+#include "rcrl_server.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+
+namespace bp = boost::process;
+
+namespace rcrl {
+
+namespace {
+
+// a corrupt size must not allocate up front, strings grow as bytes arrive
+constexpr size_t kReadChunk = 64 * 1024;
+
+void WriteString(std::ostream& out, const string& str) {
+  out << str.size() << "\n";
+  out.write(str.data(), str.size());
+}
+
+bool ReadString(std::istream& in, string& str) {
+  size_t size = 0;
+  if (!(in >> size) || in.get() != '\n') {
+    return false;
+  }
+  str.clear();
+  while (str.size() < size) {
+    const auto offset = str.size();
+    str.resize(offset + std::min(size - offset, kReadChunk));
+    if (!in.read(str.data() + offset, str.size() - offset)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void WriteList(std::ostream& out, const std::vector<string>& list) {
+  out << list.size() << "\n";
+  for (const auto& str : list) {
+    WriteString(out, str);
+  }
+}
+
+bool ReadList(std::istream& in, std::vector<string>& list) {
+  size_t size = 0;
+  if (!(in >> size) || in.get() != '\n') {
+    return false;
+  }
+  list.clear();
+  for (size_t i = 0; i < size; ++i) {
+    string str;
+    if (!ReadString(in, str)) {
+      return false;
+    }
+    list.push_back(std::move(str));
+  }
+  return true;
+}
+
+}  // namespace
+
+bool WriteRequest(std::ostream& out, const CompileRequest& request) {
+  WriteString(out, request.command);
+  WriteString(out, request.input);
+  WriteString(out, request.output);
+  WriteList(out, request.flags);
+  WriteList(out, request.link_flags);
+  WriteString(out, request.source);
+  return static_cast<bool>(out.flush());
+}
+
+bool ReadRequest(std::istream& in, CompileRequest& request) {
+  return ReadString(in, request.command) && ReadString(in, request.input) &&
+         ReadString(in, request.output) && ReadList(in, request.flags) &&
+         ReadList(in, request.link_flags) && ReadString(in, request.source);
+}
+
+bool WriteResponse(std::ostream& out, int exit_code, const string& output) {
+  WriteString(out, std::to_string(exit_code));
+  WriteString(out, output);
+  return static_cast<bool>(out.flush());
+}
+
+bool ReadResponse(std::istream& in, int& exit_code, string& output) {
+  string code;
+  if (!ReadString(in, code) || !ReadString(in, output)) {
+    return false;
+  }
+  // a response that isn't a number is as broken as a lost connection
+  char* end = nullptr;
+  errno = 0;
+  const auto value = std::strtol(code.c_str(), &end, 10);
+  if (code.empty() || *end || errno || value < INT_MIN || value > INT_MAX) {
+    return false;
+  }
+  exit_code = static_cast<int>(value);
+  return true;
+}
+
+CompileServer::CompileServer(fs::path executable)
+    : executable_(std::move(executable)) {}
+
+CompileServer::~CompileServer() {
+  if (server_.valid() && server_.running()) {
+    // the server exits on end of input
+    to_server_.pipe().close();
+    server_.wait();
+  }
+}
+
+bool CompileServer::IsAvailable() {
+#ifdef RCRL_COMPILE_SERVER
+  return fs::exists(RCRL_COMPILE_SERVER);
+#else
+  return false;
+#endif
+}
+
+bool CompileServer::Start() {
+  to_server_ = bp::opstream();
+  from_server_ = bp::ipstream();
+  std::error_code ec;
+  server_ = bp::child(executable_.string(), bp::std_in < to_server_,
+                      bp::std_out > from_server_, ec);
+  return !ec;
+}
+
+int CompileServer::Send(const CompileRequest& request, string& output,
+                        CompileJob& job) {
+  if (!(server_.valid() && server_.running()) && !Start()) {
+    output += "rcrl: couldn't start " + executable_.string() + "\n";
+    return 1;
+  }
+  // a server killed by the job breaks the connection, it is restarted by
+  // the next request
+  return job.Attach(
+      server_.id(),
+      [&] {
+        int exit_code = 1;
+        if (!WriteRequest(to_server_, request) ||
+            !ReadResponse(from_server_, exit_code, output)) {
+          if (!job.IsCancelled()) {
+            output += "rcrl: lost connection to the compile server\n";
+          }
+          std::error_code ec;
+          server_.terminate(ec);
+          return 1;
+        }
+        return exit_code;
+      },
+      [&](const char* data, size_t size) { output.append(data, size); });
+}
+
+}  // namespace rcrl
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <boost/process.hpp>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "rcrl_job.h"
+
+namespace fs = std::filesystem;
+
+namespace rcrl {
+using std::string;
+
+// Messages exchanged with rcrl_compile_server over its stdin and stdout.
+// Strings are sent as "<size>\n<bytes>" and lists as "<count>\n<items>".
+struct CompileRequest {
+  string command;  // "compile" or "pch"
+  string input;    // file name of the source or the header to precompile
+  string output;   // shared object or pch to produce
+  std::vector<string> flags;
+  std::vector<string> link_flags;
+  string source;  // only for "compile"
+};
+
+bool WriteRequest(std::ostream& out, const CompileRequest& request);
+bool ReadRequest(std::istream& in, CompileRequest& request);
+bool WriteResponse(std::ostream& out, int exit_code, const string& output);
+bool ReadResponse(std::istream& in, int& exit_code, string& output);
+
+// Client side of the long lived compile server. The server keeps the clang
+// frontend, the loaded pch and the file system caches warm across
+// submissions, so only the first compile pays for the startup.
+class CompileServer {
+ public:
+  explicit CompileServer(fs::path executable);
+  ~CompileServer();
+  static bool IsAvailable();
+  // (re)starts the server when it isn't running. Cancelling the job or
+  // reaching its deadline kills the server, the request then fails
+  int Send(const CompileRequest& request, string& output, CompileJob& job);
+
+ private:
+  bool Start();
+
+  fs::path executable_;
+  boost::process::opstream to_server_;
+  boost::process::ipstream from_server_;
+  boost::process::child server_;
+};
+
+}  // namespace rcrl
@@ -0,0 +1,45 @@
+// rcrl_compile_server - compiles plugins for rcrl::Plugin with
+// Backend::kServer. Requests come on stdin and responses go to stdout, see
+// rcrl_server.h for the protocol. Anything the linker prints goes to stderr.
+
+#include <unistd.h>
+
+#include <iostream>
+#include <sstream>
+
+#include "rcrl_jit.h"
+#include "rcrl_server.h"
+
+int main() {
+  // keep the protocol stream clean from child processes output
+  const int protocol_fd = dup(STDOUT_FILENO);
+  dup2(STDERR_FILENO, STDOUT_FILENO);
+
+  rcrl::JitEngine engine;
+  rcrl::CompileRequest request;
+  while (rcrl::ReadRequest(std::cin, request)) {
+    std::string output;
+    int exit_code = 1;
+    if (request.command == "compile") {
+      exit_code = engine.CompileSharedObject(request.source, request.input,
+                                             request.flags, request.link_flags,
+                                             request.output, output);
+    } else if (request.command == "pch") {
+      exit_code = engine.BuildPch(request.input, request.output, request.flags,
+                                  output);
+    } else {
+      output = "rcrl: unknown command " + request.command + "\n";
+    }
+    std::ostringstream response;
+    rcrl::WriteResponse(response, exit_code, output);
+    const auto str = response.str();
+    for (size_t written = 0; written < str.size();) {
+      auto n = write(protocol_fd, str.data() + written, str.size() - written);
+      if (n <= 0) {
+        return 1;
+      }
+      written += n;
+    }
+  }
+  return 0;
+}
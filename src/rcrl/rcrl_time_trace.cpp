@@ -0,0 +1,85 @@
+#include "rcrl_time_trace.h"
+
+#include <algorithm>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+namespace pt = boost::property_tree;
+
+namespace rcrl {
+
+namespace {
+
+void Accumulate(std::map<string, TimeTraceEntry>& entries, const string& name,
+                std::chrono::microseconds duration) {
+  auto& entry = entries[name];
+  entry.name = name;
+  entry.total += duration;
+  entry.count++;
+}
+
+std::vector<TimeTraceEntry> Rank(const std::map<string, TimeTraceEntry>& map,
+                                 size_t top) {
+  std::vector<TimeTraceEntry> entries;
+  entries.reserve(map.size());
+  for (const auto& [_, entry] : map) {
+    entries.push_back(entry);
+  }
+  std::stable_sort(entries.begin(), entries.end(),
+                   [](const TimeTraceEntry& a, const TimeTraceEntry& b) {
+                     return a.total > b.total;
+                   });
+  if (top && entries.size() > top) {
+    entries.resize(top);
+  }
+  return entries;
+}
+
+}  // namespace
+
+bool TimeTraceTable::Add(const fs::path& trace_file, const string& code) {
+  pt::ptree trace;
+  try {
+    pt::read_json(trace_file.string(), trace);
+  } catch (const pt::ptree_error&) {
+    return false;
+  }
+  const auto events = trace.get_child_optional("traceEvents");
+  if (!events) {
+    return false;
+  }
+  SnippetTime snippet;
+  snippet.code = code.substr(0, code.find('\n'));
+  std::lock_guard<std::mutex> lock(mut_);
+  // complete events, the summaries ("Total ...") repeat them
+  for (const auto& [_, event] : *events) {
+    const auto name = event.get<string>("name", "");
+    const auto duration =
+        std::chrono::microseconds(event.get<long long>("dur", 0));
+    if (name == "Source") {
+      Accumulate(headers_, event.get<string>("args.detail", ""), duration);
+    } else if (name == "InstantiateClass" || name == "InstantiateFunction") {
+      Accumulate(templates_, event.get<string>("args.detail", ""), duration);
+    } else if (name == "Frontend") {
+      snippet.frontend += duration;
+    } else if (name == "Backend") {
+      snippet.backend += duration;
+    }
+  }
+  snippet.compile = snippets_.size() + 1;
+  snippets_.push_back(std::move(snippet));
+  return true;
+}
+
+TimeTraceReport TimeTraceTable::GetReport(size_t top) {
+  std::lock_guard<std::mutex> lock(mut_);
+  TimeTraceReport report;
+  report.headers = Rank(headers_, top);
+  report.templates = Rank(templates_, top);
+  report.snippets.assign(
+      top && snippets_.size() > top ? snippets_.end() - top : snippets_.begin(),
+      snippets_.end());
+  return report;
+}
+
+}  // namespace rcrl
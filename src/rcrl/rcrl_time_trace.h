@@ -0,0 +1,52 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace rcrl {
+using std::string;
+
+struct TimeTraceEntry {
+  string name;  // path of the header or the template
+  std::chrono::microseconds total{0};
+  size_t count = 0;  // times it was parsed or instantiated
+};
+
+struct SnippetTime {
+  size_t compile = 0;  // 1 based, of the traced compiles of the session
+  string code;         // first line of the snippet
+  std::chrono::microseconds frontend{0};
+  std::chrono::microseconds backend{0};
+};
+
+struct TimeTraceReport {
+  // by total time, a header includes the time of the headers it includes
+  std::vector<TimeTraceEntry> headers;
+  std::vector<TimeTraceEntry> templates;
+  std::vector<SnippetTime> snippets;  // in compile order
+};
+
+// Sums the -ftime-trace files of the compiles of a session. Headers that
+// come from a pch aren't parsed, so they don't show up.
+class TimeTraceTable {
+ public:
+  // false when the file isn't a trace
+  bool Add(const fs::path& trace_file, const string& code);
+  // the top entries of each ranking and the last snippets, 0 for all
+  TimeTraceReport GetReport(size_t top = 0);
+
+ private:
+  std::mutex mut_;  // added to by the compiles, read by the host
+  std::map<string, TimeTraceEntry> headers_;
+  std::map<string, TimeTraceEntry> templates_;
+  std::vector<SnippetTime> snippets_;
+};
+
+}  // namespace rcrl
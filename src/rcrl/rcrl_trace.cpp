@@ -0,0 +1,204 @@
+#include "rcrl_trace.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+
+namespace rcrl {
+
+namespace {
+
+constexpr size_t kTraceCapacity = 4096;  // spans per thread
+
+// written by its thread only, head is published after the slot it counts
+struct TraceBuffer {
+  uint32_t thread = 0;
+  std::atomic<bool> in_use{true};
+  std::atomic<uint64_t> head{0};     // spans ever recorded
+  std::atomic<uint64_t> cleared{0};  // head at the last ClearTrace
+  struct Slot {
+    std::atomic<const char*> name{nullptr};
+    std::atomic<int64_t> start{0};
+    std::atomic<int64_t> duration{0};
+  };
+  std::array<Slot, kTraceCapacity> slots;
+};
+
+std::atomic<bool> tracing(false);
+const auto trace_origin = std::chrono::steady_clock::now();
+std::mutex buffers_mut;  // taken when a thread first records and to collect
+
+// never freed, threads may still record while the process exits
+std::vector<std::unique_ptr<TraceBuffer>>& GetBuffers() {
+  static auto buffers = new std::vector<std::unique_ptr<TraceBuffer>>();
+  return *buffers;
+}
+
+// hands the buffer on to the next new thread once its thread exits
+struct BufferOwner {
+  TraceBuffer* buffer = nullptr;
+  ~BufferOwner() {
+    if (buffer) {
+      buffer->in_use.store(false, std::memory_order_release);
+    }
+  }
+};
+
+TraceBuffer& GetThreadBuffer() {
+  thread_local BufferOwner owner;
+  if (!owner.buffer) {
+    std::lock_guard<std::mutex> lock(buffers_mut);
+    auto& buffers = GetBuffers();
+    for (auto& buffer : buffers) {
+      bool in_use = false;
+      if (buffer->in_use.compare_exchange_strong(in_use, true,
+                                                 std::memory_order_acquire)) {
+        owner.buffer = buffer.get();
+        break;
+      }
+    }
+    if (!owner.buffer) {
+      buffers.push_back(std::make_unique<TraceBuffer>());
+      buffers.back()->thread = buffers.size();
+      owner.buffer = buffers.back().get();
+    }
+  }
+  return *owner.buffer;
+}
+
+void Record(const char* name, std::chrono::steady_clock::time_point start,
+            std::chrono::steady_clock::duration duration) {
+  auto& buffer = GetThreadBuffer();
+  const auto i = buffer.head.load(std::memory_order_relaxed);
+  auto& slot = buffer.slots[i % kTraceCapacity];
+  // a reader that sees any of the stores below also sees head at i
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.name.store(name, std::memory_order_relaxed);
+  slot.start.store(
+      std::chrono::nanoseconds(start - trace_origin).count(),
+      std::memory_order_relaxed);
+  slot.duration.store(std::chrono::nanoseconds(duration).count(),
+                      std::memory_order_relaxed);
+  buffer.head.store(i + 1, std::memory_order_release);
+}
+
+void Collect(const TraceBuffer& buffer, std::vector<TraceEvent>& events) {
+  const auto end = buffer.head.load(std::memory_order_acquire);
+  const auto begin =
+      std::max(end > kTraceCapacity ? end - kTraceCapacity : 0,
+               buffer.cleared.load(std::memory_order_relaxed));
+  if (begin >= end) {
+    return;
+  }
+  std::vector<TraceEvent> copied;
+  copied.reserve(end - begin);
+  for (auto i = begin; i < end; ++i) {
+    const auto& slot = buffer.slots[i % kTraceCapacity];
+    copied.push_back(
+        {slot.name.load(std::memory_order_relaxed),
+         std::chrono::nanoseconds(slot.start.load(std::memory_order_relaxed)),
+         std::chrono::nanoseconds(
+             slot.duration.load(std::memory_order_relaxed)),
+         buffer.thread});
+  }
+  // the slots of the spans recorded meanwhile, and of the one being
+  // recorded, may have been overwritten while they were copied
+  std::atomic_thread_fence(std::memory_order_acquire);
+  const auto after = buffer.head.load(std::memory_order_relaxed);
+  const auto valid = after + 1 > kTraceCapacity ? after + 1 - kTraceCapacity
+                                                : 0;
+  for (auto i = std::max(begin, valid); i < end; ++i) {
+    events.push_back(copied[i - begin]);
+  }
+}
+
+}  // namespace
+
+void SetTracing(bool enabled) {
+  tracing.store(enabled, std::memory_order_relaxed);
+}
+
+bool IsTracing() { return tracing.load(std::memory_order_relaxed); }
+
+void AddTraceEvent(const char* name,
+                   std::chrono::steady_clock::time_point start,
+                   std::chrono::steady_clock::duration duration) {
+  if (IsTracing()) {
+    Record(name, start, duration);
+  }
+}
+
+std::vector<TraceEvent> GetTraceEvents() {
+  std::vector<TraceEvent> events;
+  {
+    std::lock_guard<std::mutex> lock(buffers_mut);
+    for (const auto& buffer : GetBuffers()) {
+      Collect(*buffer, events);
+    }
+  }
+  std::stable_sort(events.begin(), events.end(),
+                   [](const TraceEvent& a, const TraceEvent& b) {
+                     return a.start < b.start;
+                   });
+  return events;
+}
+
+void ClearTrace() {
+  std::lock_guard<std::mutex> lock(buffers_mut);
+  for (auto& buffer : GetBuffers()) {
+    buffer->cleared.store(buffer->head.load(std::memory_order_acquire),
+                          std::memory_order_relaxed);
+  }
+}
+
+string ToChromeTrace(const std::vector<TraceEvent>& events) {
+  std::ostringstream json;
+  json.setf(std::ios::fixed);
+  json.precision(3);
+  json << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+  for (size_t i = 0; i < events.size(); ++i) {
+    const auto& event = events[i];
+    string name;
+    for (const char* c = event.name; *c; ++c) {
+      if (*c == '"' || *c == '\\') {
+        name += '\\';
+      }
+      name += *c;
+    }
+    // complete events, in microseconds
+    json << (i ? ",\n" : "\n") << "{\"name\": \"" << name
+         << "\", \"ph\": \"X\", \"pid\": " << getpid()
+         << ", \"tid\": " << event.thread
+         << ", \"ts\": " << event.start.count() / 1000.0
+         << ", \"dur\": " << event.duration.count() / 1000.0 << "}";
+  }
+  json << "\n]}\n";
+  return json.str();
+}
+
+bool WriteChromeTrace(const fs::path& file) {
+  std::ofstream out(file, std::fstream::out | std::fstream::trunc);
+  out << ToChromeTrace(GetTraceEvents());
+  return static_cast<bool>(out);
+}
+
+TraceScope::TraceScope(const char* name)
+    : name_(IsTracing() ? name : nullptr) {
+  if (name_) {
+    start_ = std::chrono::steady_clock::now();
+  }
+}
+
+TraceScope::~TraceScope() {
+  if (name_) {
+    Record(name_, start_, std::chrono::steady_clock::now() - start_);
+  }
+}
+
+}  // namespace rcrl
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace rcrl {
+using std::string;
+
+struct TraceEvent {
+  const char* name;
+  std::chrono::nanoseconds start;  // since the process started tracing
+  std::chrono::nanoseconds duration;
+  uint32_t thread;  // of the buffer, threads that exited hand theirs on
+};
+
+// Spans of the work done for the submissions, off by default. Every thread
+// records into a fixed ring buffer of its own without locking, the oldest
+// spans are overwritten. Collecting copies them while they are recorded.
+void SetTracing(bool enabled);
+bool IsTracing();
+// names must outlive the trace, e.g. string literals
+void AddTraceEvent(const char* name,
+                   std::chrono::steady_clock::time_point start,
+                   std::chrono::steady_clock::duration duration);
+// the spans of all threads since the last ClearTrace, by start
+std::vector<TraceEvent> GetTraceEvents();
+void ClearTrace();
+// trace event format, opens in Perfetto and chrome://tracing
+string ToChromeTrace(const std::vector<TraceEvent>& events);
+bool WriteChromeTrace(const fs::path& file);
+
+// records the span of its lifetime when tracing is on
+class TraceScope {
+ public:
+  explicit TraceScope(const char* name);
+  ~TraceScope();
+  TraceScope(const TraceScope&) = delete;
+  TraceScope& operator=(const TraceScope&) = delete;
+
+ private:
+  const char* name_;  // nullptr when not tracing
+  std::chrono::steady_clock::time_point start_;
+};
+
+}  // namespace rcrl
@@ -0,0 +1,51 @@
+#include "rcrl_trampoline.h"
+
+#include <algorithm>
+
+namespace rcrl {
+
+TrampolineTable::TrampolineTable(size_t capacity)
+    : capacity_(capacity), slots_(new void*[capacity]()) {}
+
+void** TrampolineTable::GetSlot(const string& symbol, const string& type) {
+  std::lock_guard<std::mutex> lock(mut_);
+  auto it = entries_.find(symbol);
+  if (it == entries_.end()) {
+    if (entries_.size() == capacity_) {
+      return nullptr;
+    }
+    it = entries_.emplace(symbol, Entry{entries_.size(), false, type}).first;
+  }
+  // the callers cast the slot to the type they were compiled with
+  if (it->second.type != type) {
+    return nullptr;
+  }
+  return &slots_[it->second.index];
+}
+
+bool TrampolineTable::IsDefined(const string& symbol) {
+  std::lock_guard<std::mutex> lock(mut_);
+  auto it = entries_.find(symbol);
+  return it != entries_.end() && it->second.defined;
+}
+
+void TrampolineTable::SetDefined(const string& symbol) {
+  std::lock_guard<std::mutex> lock(mut_);
+  auto it = entries_.find(symbol);
+  if (it != entries_.end()) {
+    it->second.defined = true;
+  }
+}
+
+void TrampolineTable::Reset() {
+  std::lock_guard<std::mutex> lock(mut_);
+  std::fill(slots_.get(), slots_.get() + entries_.size(), nullptr);
+  entries_.clear();
+}
+
+size_t TrampolineTable::get_size() {
+  std::lock_guard<std::mutex> lock(mut_);
+  return entries_.size();
+}
+
+}  // namespace rcrl
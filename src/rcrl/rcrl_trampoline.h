@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace rcrl {
+using std::string;
+
+// Host side table of function pointers. An exported function of the
+// snippets is called through the slot of its symbol, so redefining it
+// repoints the slot and every caller, whenever it was compiled, picks up the
+// new body. Slots are patched by the plugins with atomic stores.
+class TrampolineTable {
+ public:
+  explicit TrampolineTable(size_t capacity = size_t(1) << 16);
+  // slot of symbol, allocated on first use for a function of the given
+  // type. nullptr when the table is full or the slot calls another type,
+  // which the mangled name doesn't tell apart, e.g. by the return type
+  void** GetSlot(const string& symbol, const string& type);
+  // whether a loaded plugin exports the function calling through the slot
+  bool IsDefined(const string& symbol);
+  void SetDefined(const string& symbol);
+  // forgets every symbol, the slots must not be called anymore
+  void Reset();
+  size_t get_size();
+
+ private:
+  struct Entry {
+    size_t index;
+    bool defined;
+    string type;  // canonical spelling of the function type
+  };
+  const size_t capacity_;
+  // never reallocated, the plugins hold the slot addresses
+  std::unique_ptr<void*[]> slots_;
+  std::map<string, Entry> entries_;
+  std::mutex mut_;
+};
+
+}  // namespace rcrl
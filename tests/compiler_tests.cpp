@@ -1,4 +1,8 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
 #include "../src/rcrl/rcrl.h"
 #include "doctest/doctest/doctest.h"
 
@@ -20,6 +24,679 @@ TEST_CASE("single variables") {
   p.CopyAndLoadNewPlugin();
 }
 
+TEST_CASE("changed prelude") {
+  int exitcode = 0;
+  const auto header = rcrl::kRcrlOutputDir / "rcrl_test_prelude.h";
+  std::ofstream(header) << "inline int prelude_a = 1;\n";
+
+  rcrl::Plugin p(fs::path(), {}, {"\"" + header.string() + "\""});
+  p.CompileCode("int a = prelude_a;");
+  while (!p.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE_FALSE(exitcode);
+  p.CopyAndLoadNewPlugin();
+  // edited while the session is open, the pch is rebuilt
+  std::ofstream(header) << "inline int prelude_a = 1;\n"
+                        << "inline int prelude_b = 2;\n";
+  p.CompileCode("int b = prelude_b;");
+  while (!p.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE_FALSE(exitcode);
+  p.CopyAndLoadNewPlugin();
+  p.CleanupPlugins();
+  fs::remove(header);
+}
+
+TEST_CASE("artifact cache") {
+  int exitcode = 0;
+  const auto cache_dir = rcrl::kRcrlOutputDir / "rcrl_test_cache";
+  fs::remove_all(cache_dir);
+
+  // the second session replays the first one and shouldn't compile
+  for (size_t run = 0; run < 2; ++run) {
+    rcrl::Plugin p;
+    p.set_artifact_cache(cache_dir, 64 << 20);
+    p.CompileCode("int cached = 5;");
+    while (!p.TryGetExitStatusFromCompile(exitcode))
+      ;
+    REQUIRE_FALSE(exitcode);
+    p.CopyAndLoadNewPlugin();
+    REQUIRE(p.get_cache_stats().hits == run);
+    REQUIRE(p.get_cache_stats().entries == 1);
+  }
+
+  // a plugin built against an older prelude header isn't reused
+  const auto header = rcrl::kRcrlOutputDir / "rcrl_test_cache_prelude.h";
+  for (auto layout : {"struct Shape { int a; };",
+                      "struct Shape { long a; };"}) {
+    std::ofstream(header) << layout << "\n";
+    rcrl::Plugin p(fs::path(), {}, {"\"" + header.string() + "\""});
+    p.set_artifact_cache(cache_dir, 64 << 20);
+    p.CompileCode("Shape shape;");
+    while (!p.TryGetExitStatusFromCompile(exitcode))
+      ;
+    REQUIRE_FALSE(exitcode);
+    p.CopyAndLoadNewPlugin();
+    REQUIRE(p.get_cache_stats().hits == 0);
+  }
+  fs::remove(header);
+}
+
+TEST_CASE("speculative compile") {
+  int exitcode = 0;
+  const auto cache_dir = rcrl::kRcrlOutputDir / "rcrl_test_speculation";
+  fs::remove_all(cache_dir);
+
+  rcrl::Plugin p;
+  p.set_artifact_cache(cache_dir, 64 << 20);
+  // the stale speculation is cancelled and never reaches the cache
+  REQUIRE(p.CompileSpeculatively("int speculated = 4;"));
+  REQUIRE(p.CompileSpeculatively("int speculated = 5;"));
+  p.CompileCode("int speculated = 5;");
+  while (!p.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE_FALSE(exitcode);
+  p.CopyAndLoadNewPlugin();
+  REQUIRE(p.get_cache_stats().hits == 1);
+  REQUIRE(p.get_cache_stats().entries == 1);
+  // it would reserve arena slots for code that may never be loaded
+  p.set_variable_arena(true);
+  REQUIRE_FALSE(p.CompileSpeculatively("int unloaded = 6;"));
+  REQUIRE(p.get_arena_stats().variables == 0);
+}
+
+TEST_CASE("compile timeout") {
+  int exitcode = 0;
+
+  rcrl::Plugin p;
+  rcrl::CompileLimits limits;
+  limits.timeout = std::chrono::milliseconds(200);
+  p.set_compile_limits(limits);
+  // 10^10 repetitions for the assembler, this never finishes compiling.
+  // libclang doesn't look into the asm, only clang++ spins until killed
+  const string slow =
+      "int slow() {\n"
+      "  asm(\".rept 100000\\n.rept 100000\\n.set spin, 0\\n"
+      ".endr\\n.endr\");\n"
+      "  return 0;\n"
+      "}\n";
+  p.CompileCode(slow);
+  while (!p.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE(exitcode);
+  REQUIRE(p.get_new_compiler_output().find("timed out") != string::npos);
+
+  // destroyed mid compile, the task must not outlive the plugin
+  {
+    rcrl::Plugin busy;
+    busy.CompileCode(slow);
+  }
+}
+
+TEST_CASE("concurrent sessions") {
+  int exitcode = 0;
+  auto scheduler = std::make_shared<rcrl::CompileScheduler>(2);
+
+  rcrl::Plugin first;
+  rcrl::Plugin second;
+  REQUIRE(first.get_session_dir() != second.get_session_dir());
+  first.set_scheduler(scheduler);
+  second.set_scheduler(scheduler);
+  first.CompileCode("int from_first = 1;");
+  second.CompileCode("int from_second = 2;");
+  for (auto p : {&first, &second}) {
+    while (!p->TryGetExitStatusFromCompile(exitcode))
+      ;
+    REQUIRE_FALSE(exitcode);
+    p->CopyAndLoadNewPlugin();
+  }
+
+  // the same name in both sessions, each one sees its own variable
+  first.CompileCode("int same_name = 1;");
+  second.CompileCode("int same_name = 2;");
+  for (auto p : {&first, &second}) {
+    while (!p->TryGetExitStatusFromCompile(exitcode))
+      ;
+    REQUIRE_FALSE(exitcode);
+    p->CopyAndLoadNewPlugin();
+  }
+  first.CompileCode("std::cout << same_name;");
+  second.CompileCode("std::cout << same_name;");
+  for (auto p : {&first, &second}) {
+    while (!p->TryGetExitStatusFromCompile(exitcode))
+      ;
+    REQUIRE_FALSE(exitcode);
+  }
+  REQUIRE(first.CopyAndLoadNewPlugin(true) == "1");
+  REQUIRE(second.CopyAndLoadNewPlugin(true) == "2");
+  // a redefinition used right away is no ambiguity for the preflight
+  first.CompileCode("int same_name = 3;\nint get() { return same_name; }");
+  while (!first.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE_FALSE(exitcode);
+}
+
+TEST_CASE("parse service") {
+  int exitcode = 0;
+  auto service = std::make_shared<rcrl::ParseService>(2);
+
+  {
+    rcrl::Plugin first;
+    rcrl::Plugin second;
+    first.set_parse_service(service);
+    second.set_parse_service(service);
+    // both sessions have the default prelude, it's precompiled once
+    REQUIRE(service->get_stats().preambles == 1);
+    REQUIRE(service->get_stats().parsers == 2);
+    first.CompileCode("int parsed_first = 1;");
+    second.CompileCode("int parsed_second = 2;");
+    for (auto p : {&first, &second}) {
+      while (!p->TryGetExitStatusFromCompile(exitcode))
+        ;
+      REQUIRE_FALSE(exitcode);
+      p->CopyAndLoadNewPlugin();
+    }
+  }
+  REQUIRE(service->get_stats().parsers == 0);
+}
+
+TEST_CASE("completion") {
+  int exitcode = 0;
+  std::vector<rcrl::Completion> completions;
+
+  rcrl::Plugin p;
+  p.CompileCode(
+      "std::vector<int> completed_vector;\n"
+      "int completed_function(int x) { return x; }");
+  while (!p.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE_FALSE(exitcode);
+  p.CopyAndLoadNewPlugin();
+  // the declarations of the loaded plugin
+  p.RequestCompletion("completed_", 1, 11);
+  while (!p.TryGetCompletions(completions))
+    ;
+  REQUIRE(completions.size() == 2);
+  REQUIRE(completions[0].typed == 10);
+  // members of a variable of the plugin
+  p.RequestCompletion("completed_vector.push_", 1, 23);
+  while (!p.TryGetCompletions(completions))
+    ;
+  REQUIRE_FALSE(completions.empty());
+  REQUIRE(completions[0].text == "push_back");
+  // the same context with std in scope completes more of the headers
+  auto has_vector = [&] {
+    return std::any_of(
+        completions.begin(), completions.end(),
+        [](const rcrl::Completion& c) { return c.text == "vector"; });
+  };
+  p.RequestCompletion("vecto", 1, 6);
+  while (!p.TryGetCompletions(completions))
+    ;
+  REQUIRE_FALSE(has_vector());
+  p.RequestCompletion("using namespace std;\nvecto", 2, 6);
+  while (!p.TryGetCompletions(completions))
+    ;
+  REQUIRE(has_vector());
+}
+
+TEST_CASE("phase timing") {
+  int exitcode = 0;
+
+  rcrl::Plugin p;
+  p.set_phase_timing(true);
+  p.CompileCode(
+      "#include <chrono>\n#include <thread>\n"
+      "std::this_thread::sleep_for(std::chrono::milliseconds(20));");
+  while (!p.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE_FALSE(exitcode);
+  p.CopyAndLoadNewPlugin();
+  const auto timings = p.get_last_timings();
+  REQUIRE(timings.reparse.count() > 0);
+  REQUIRE(timings.compile.count() > 0);
+  REQUIRE(timings.link.count() > 0);
+  // the statement runs while the plugin is initialized
+  REQUIRE(timings.static_init >= std::chrono::milliseconds(20));
+  REQUIRE_FALSE(timings.cached);
+}
+
+TEST_CASE("tracing") {
+  int exitcode = 0;
+
+  rcrl::Plugin p;
+  rcrl::ClearTrace();
+  rcrl::SetTracing(true);
+  p.CompileCode("int traced = 1;");
+  while (!p.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE_FALSE(exitcode);
+  p.CopyAndLoadNewPlugin();
+  rcrl::SetTracing(false);
+  const auto events = rcrl::GetTraceEvents();
+  std::string names = "\n";
+  for (const auto& event : events) {
+    names += event.name + std::string("\n");
+  }
+  for (auto name : {"CompileCode", "Reparse", "GenerateSourceFile", "spawn",
+                    "clang++", "dlopen"}) {
+    REQUIRE(names.find("\n" + std::string(name) + "\n") != std::string::npos);
+  }
+  const auto json = rcrl::ToChromeTrace(events);
+  REQUIRE(json.find("\"name\": \"Reparse\", \"ph\": \"X\"") !=
+          std::string::npos);
+  rcrl::ClearTrace();
+  REQUIRE(rcrl::GetTraceEvents().empty());
+}
+
+TEST_CASE("time trace") {
+  int exitcode = 0;
+
+  rcrl::Plugin p;
+  p.set_time_trace(true);
+  p.CompileCode("#include <map>\nstd::map<int, int> traced = {{1, 2}};");
+  while (!p.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE_FALSE(exitcode);
+  p.CopyAndLoadNewPlugin();
+  auto report = p.get_time_trace_report();
+  // the prelude comes from the pch, <map> is parsed
+  bool parsed_map = false;
+  for (const auto& header : report.headers) {
+    parsed_map |= header.name.find("map") != std::string::npos;
+  }
+  REQUIRE(parsed_map);
+  REQUIRE(report.snippets.size() == 1);
+  REQUIRE(report.snippets[0].code == "#include <map>");
+  REQUIRE(report.snippets[0].frontend.count() > 0);
+  REQUIRE(p.get_time_trace_report(1).headers.size() == 1);
+  // enabling again starts over
+  p.set_time_trace(false);
+  p.set_time_trace(true);
+  report = p.get_time_trace_report();
+  REQUIRE(report.headers.empty());
+  REQUIRE(report.snippets.empty());
+}
+
+TEST_CASE("snippet parts") {
+  int exitcode = 0;
+
+  rcrl::Plugin p;
+  auto parts = p.ParseSnippet("int x = 1;");
+  REQUIRE(parts.globals);
+  REQUIRE_FALSE(parts.statements);
+  parts = p.ParseSnippet("x = 2; // again\n", "int x = 1;");
+  REQUIRE_FALSE(parts.globals);
+  REQUIRE(parts.statements);
+  // knows the declarations of the context
+  parts = p.ParseSnippet("int y = x;", "int x = 1;\nx = 2;");
+  REQUIRE(parts.globals);
+  REQUIRE_FALSE(parts.statements);
+  parts = p.ParseSnippet("/* nothing */;");
+  REQUIRE_FALSE(parts.globals);
+  REQUIRE_FALSE(parts.statements);
+  // compiles as if nothing was parsed in between
+  p.CompileCode("int parts = 1;");
+  while (!p.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE_FALSE(exitcode);
+  p.CopyAndLoadNewPlugin();
+}
+
+TEST_CASE("captured output") {
+  int exitcode = 0;
+
+  rcrl::Plugin p;
+  p.set_program_output_limit(4, rcrl::Truncation::kKeepTail);
+  p.CompileCode("std::cout << \"hello\" << std::endl;");
+  while (!p.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE_FALSE(exitcode);
+  auto out = p.CopyAndLoadNewPlugin(true);
+  REQUIRE(out == "\n[rcrl: 2 bytes of output dropped]\nllo\n");
+  REQUIRE(p.get_new_program_output() == out);
+}
+
+TEST_CASE("namespaces") {
+  int exitcode = 0;
+
+  rcrl::Plugin p;
+  const char* submissions[] = {
+      "namespace a {\nint x = 1;\nnamespace b {\nint f() { return x + 1; }\n}"
+      "\n}\nnamespace a { int y = b::f(); }",
+      "std::cout << a::x + a::y + a::b::f();"};
+  string out;
+  for (auto code : submissions) {
+    p.CompileCode(code);
+    while (!p.TryGetExitStatusFromCompile(exitcode))
+      ;
+    REQUIRE_FALSE(exitcode);
+    out = p.CopyAndLoadNewPlugin(true);
+  }
+  REQUIRE(out == "5");
+}
+
+TEST_CASE("parse cache") {
+  int exitcode = 0;
+
+  rcrl::Plugin p;
+  p.set_flags({"-std=c++17"});
+  while (p.IsCompiling())
+    ;
+  p.set_flags({"-std=c++17", "-DPROFILE=2"});
+  while (p.IsCompiling())
+    ;
+  // back to a recent flag set without parsing again
+  p.set_flags({" -std=c++17 "});
+  REQUIRE_FALSE(p.IsCompiling());
+  auto stats = p.get_parse_cache_stats();
+  REQUIRE(stats.size() == 3);
+  REQUIRE(stats[0].flags == "-std=c++17");
+  REQUIRE(stats[0].current);
+  REQUIRE(stats[0].memory_bytes > 0);
+  // a repeated flag is another flag set, e.g. "-Xclang" before two options
+  p.set_flags({"-std=c++17", "-std=c++17"});
+  while (p.IsCompiling())
+    ;
+  REQUIRE(p.get_parse_cache_stats()[0].flags == "-std=c++17\n-std=c++17");
+  p.set_parse_cache_size(1);
+  REQUIRE(p.get_parse_cache_stats().size() == 1);
+  p.CompileCode("int x = 1;");
+  while (!p.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE_FALSE(exitcode);
+}
+
+TEST_CASE("diagnostics") {
+  int exitcode = 0;
+
+  rcrl::Plugin p;
+  p.CompileCode("int fine = 1;\nfine += undeclared;\n");
+  while (!p.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE(exitcode);
+  auto diagnostics = p.get_new_diagnostics();
+  REQUIRE(diagnostics.size());
+  REQUIRE(diagnostics[0].severity == rcrl::Severity::kError);
+  REQUIRE(diagnostics[0].code_line == 2);
+}
+
+TEST_CASE("in memory source") {
+  int exitcode = 0;
+
+  rcrl::Plugin p;
+  const auto file = p.get_session_dir() / "plugin.cpp";
+  const auto size = fs::file_size(file);
+  p.CompileCode("int answer = 42;\nstd::cout << answer;");
+  while (!p.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE_FALSE(exitcode);
+  REQUIRE(p.CopyAndLoadNewPlugin(true) == "42");
+  // neither the code nor the generated source went through the file
+  REQUIRE(fs::file_size(file) == size);
+}
+
+TEST_CASE("preflight") {
+  int exitcode = 0;
+
+  rcrl::Plugin p;
+  p.CompileCode("int ok = 1;\nint broken() { return undeclared; }\n");
+  while (!p.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE(exitcode);
+  REQUIRE(p.get_new_compiler_output().find("not compiled") != string::npos);
+  auto diagnostics = p.get_new_diagnostics();
+  REQUIRE(diagnostics.size() == 1);
+  REQUIRE(diagnostics[0].code_line == 2);
+}
+
+TEST_CASE("chained headers") {
+  int exitcode = 0;
+
+  rcrl::Plugin p;
+  const char* submissions[] = {"struct Point { int x, y; };",
+                               "Point origin{0, 0};",
+                               "int norm(Point q) { return q.x + q.y; }",
+                               "origin.x = norm(origin) + 1;"};
+  for (auto code : submissions) {
+    p.CompileCode(code);
+    while (!p.TryGetExitStatusFromCompile(exitcode))
+      ;
+    REQUIRE_FALSE(exitcode);
+    p.CopyAndLoadNewPlugin();
+  }
+  // each submission but the last one is precompiled on top of the previous
+  const auto session = p.get_session_dir();
+  REQUIRE(fs::exists(session / "plugin_2.hpp.pch"));
+  REQUIRE(fs::exists(session / "plugin_3.hpp"));
+  REQUIRE_FALSE(fs::exists(session / "plugin_3.hpp.pch"));
+  p.CleanupPlugins();
+  REQUIRE_FALSE(fs::exists(session / "plugin_0.hpp"));
+}
+
+TEST_CASE("compaction") {
+  int exitcode = 0;
+
+  rcrl::Plugin p;
+  const char* submissions[] = {
+      "int values[4] = {1, 2};", "values[2] = 3;",
+      "int sum() { int s = 0; for (int v : values) s += v; return s; }"};
+  for (auto code : submissions) {
+    p.CompileCode(code);
+    while (!p.TryGetExitStatusFromCompile(exitcode))
+      ;
+    REQUIRE_FALSE(exitcode);
+    p.CopyAndLoadNewPlugin();
+  }
+  p.CompactPlugins();
+  auto report = p.get_last_compaction();
+  REQUIRE(report.compacted);
+  REQUIRE(report.plugins_before == 3);
+  REQUIRE(report.plugins_after == 1);
+  REQUIRE(report.mappings_after < report.mappings_before);
+  // the state moved into the merged library
+  p.CompileCode("values[3] = 4;\nstd::cout << sum();");
+  while (!p.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE_FALSE(exitcode);
+  REQUIRE(p.CopyAndLoadNewPlugin(true) == "10");
+
+  // these point into the code of the plugin that created them
+  rcrl::Plugin q;
+  const char* unmovable[] = {
+      "#include <functional>\n"
+      "std::function<int()> callback = [] { return 1; };",
+      "#include <memory>\nauto shared = std::make_shared<int>(2);"};
+  for (auto code : unmovable) {
+    q.CompileCode(code);
+    while (!q.TryGetExitStatusFromCompile(exitcode))
+      ;
+    REQUIRE_FALSE(exitcode);
+    q.CopyAndLoadNewPlugin();
+  }
+  q.CompactPlugins();
+  report = q.get_last_compaction();
+  REQUIRE_FALSE(report.compacted);
+  REQUIRE(report.plugins_after == 2);
+  REQUIRE(report.error.find("callback") != string::npos);
+  // so do the pointers of a POD, the literal goes with the unloaded plugin
+  rcrl::Plugin l;
+  l.CompileCode("const char* literal = \"lit\";");
+  while (!l.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE_FALSE(exitcode);
+  l.CopyAndLoadNewPlugin();
+  l.CompileCode("std::cout << literal;");
+  while (!l.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE_FALSE(exitcode);
+  REQUIRE(l.CopyAndLoadNewPlugin(true) == "lit");
+  l.CompactPlugins();
+  REQUIRE_FALSE(l.get_last_compaction().compacted);
+  REQUIRE(l.get_last_compaction().error.find("literal") != string::npos);
+
+  // the last definition is merged, static state would start over
+  rcrl::Plugin r;
+  const char* redefinitions[] = {
+      "int value = 1;\nint get() { return value; }",
+      "int value = 2;\nint get() { return 10 * value; }"};
+  for (auto code : redefinitions) {
+    r.CompileCode(code);
+    while (!r.TryGetExitStatusFromCompile(exitcode))
+      ;
+    REQUIRE_FALSE(exitcode);
+    r.CopyAndLoadNewPlugin();
+  }
+  r.CompactPlugins();
+  REQUIRE(r.get_last_compaction().compacted);
+  r.CompileCode("static int counter = 5;\nstd::cout << get();");
+  while (!r.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE_FALSE(exitcode);
+  REQUIRE(r.CopyAndLoadNewPlugin(true) == "20");
+  r.CompactPlugins();
+  REQUIRE_FALSE(r.get_last_compaction().compacted);
+  REQUIRE(r.get_last_compaction().error.find("counter") != string::npos);
+}
+
+TEST_CASE("variable arena") {
+  int exitcode = 0;
+
+  rcrl::Plugin p;
+  p.set_variable_arena(true);
+  const char* submissions[] = {
+      "struct Point { int x, y; };\nPoint point{1, 2};", "point.x += 2;"};
+  for (auto code : submissions) {
+    p.CompileCode(code);
+    while (!p.TryGetExitStatusFromCompile(exitcode))
+      ;
+    REQUIRE_FALSE(exitcode);
+    p.CopyAndLoadNewPlugin();
+  }
+  REQUIRE(p.get_arena_stats().variables == 1);
+  REQUIRE(p.get_arena_stats().used_bytes >= 2 * sizeof(int));
+  // failed submissions don't leave slots behind, they fail to link
+  for (int i = 0; i < 2; ++i) {
+    p.CompileCode("int missing();\nint linked = missing();");
+    while (!p.TryGetExitStatusFromCompile(exitcode))
+      ;
+    REQUIRE(exitcode);
+  }
+  REQUIRE(p.get_arena_stats().variables == 2);
+  // the merged library only refers to the state, it doesn't move it
+  p.CompactPlugins();
+  REQUIRE(p.get_last_compaction().compacted);
+  p.CompileCode("std::cout << point.x;");
+  while (!p.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE_FALSE(exitcode);
+  REQUIRE(p.CopyAndLoadNewPlugin(true) == "3");
+  // these point into the code of their plugin, which they'd outlive
+  p.CompileCode(
+      "#include <functional>\n"
+      "struct Base { virtual int f() { return 1; } };\n"
+      "Base base;\n"
+      "std::function<int()> callback = [] { return base.f(); };\n"
+      "const char* literal = \"lit\";");
+  while (!p.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE_FALSE(exitcode);
+  p.CopyAndLoadNewPlugin();
+  REQUIRE(p.get_arena_stats().variables == 2);
+  p.CleanupPlugins();
+  REQUIRE(p.get_arena_stats().variables == 0);
+}
+
+TEST_CASE("trampolines") {
+  int exitcode = 0;
+
+  rcrl::Plugin p;
+  p.set_trampolines(true);
+  // use() is compiled once and calls whichever twice() is current
+  const char* submissions[] = {"int twice(int x) { return 2 * x; }",
+                               "int use() { return twice(5); }",
+                               "int twice(int x) { return x + x + 1; }",
+                               "RCRL_DIRECT int hot() { return use(); }"};
+  for (auto code : submissions) {
+    p.CompileCode(code);
+    while (!p.TryGetExitStatusFromCompile(exitcode))
+      ;
+    REQUIRE_FALSE(exitcode);
+    p.CopyAndLoadNewPlugin();
+  }
+  p.CompileCode("std::cout << hot();");
+  while (!p.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE_FALSE(exitcode);
+  REQUIRE(p.CopyAndLoadNewPlugin(true) == "11");
+  // the redefinition no longer keeps the plugins from being merged
+  p.CompactPlugins();
+  REQUIRE(p.get_last_compaction().compacted);
+  p.CompileCode("std::cout << use();");
+  while (!p.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE_FALSE(exitcode);
+  REQUIRE(p.CopyAndLoadNewPlugin(true) == "11");
+  // heads the body can't be made static with are called directly
+  p.CompileCode(
+      "extern int linked() { return 7; }\n"
+      "__attribute__((noinline)) int kept() { return 8; }");
+  while (!p.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE_FALSE(exitcode);
+  p.CopyAndLoadNewPlugin();
+  p.CompileCode("std::cout << linked() + kept();");
+  while (!p.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE_FALSE(exitcode);
+  REQUIRE(p.CopyAndLoadNewPlugin(true) == "15");
+
+  // callers cast the slot to their type, another one gets no slot
+  rcrl::TrampolineTable table;
+  auto slot = table.GetSlot("_Z1fv", "int ()");
+  REQUIRE(slot);
+  REQUIRE(table.GetSlot("_Z1fv", "int ()") == slot);
+  REQUIRE_FALSE(table.GetSlot("_Z1fv", "double ()"));
+}
+
+TEST_CASE("server protocol") {
+  int exitcode = 0;
+
+  // a broken response is a failed compile, not an exception
+  for (auto response : {"2\nok\n0\n", "1\n\n0\n", "0\n0\n", "3\n12\n",
+                        "99999999999999\n", "-1\n", "1\n0\n-1\nok"}) {
+    std::istringstream in(response);
+    string output;
+    REQUIRE_FALSE(rcrl::ReadResponse(in, exitcode, output));
+  }
+  std::istringstream in("1\n0\n2\nok");
+  string output;
+  REQUIRE(rcrl::ReadResponse(in, exitcode, output));
+  REQUIRE(exitcode == 0);
+  REQUIRE(output == "ok");
+}
+
+#ifdef RCRL_WITH_JIT
+TEST_CASE("jit backend") {
+  int exitcode = 0;
+
+  rcrl::Plugin p;
+  REQUIRE(p.set_backend(rcrl::Backend::kJit));
+
+  p.CompileCode("int a = 5;");
+  while (!p.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE_FALSE(exitcode);
+  p.CopyAndLoadNewPlugin();
+
+  p.CompileCode("a++;");
+  while (!p.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE_FALSE(exitcode);
+  p.CopyAndLoadNewPlugin();
+}
+#endif
+
 #ifndef __APPLE__
 
 #ifdef _WIN32
@@ -33,6 +710,32 @@ RCRL_SYMBOL_EXPORT void test_ctor_dtor_order(int num) {
   g_pushed_ints.push_back(num);
 }
 
+#ifdef RCRL_WITH_JIT
+TEST_CASE("server backend") {
+  int exitcode = 0;
+
+  rcrl::Plugin p;
+  REQUIRE(p.set_backend(rcrl::Backend::kServer));
+
+  p.CompileCode("int a = 5;");
+  while (!p.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE_FALSE(exitcode);
+  p.CopyAndLoadNewPlugin();
+
+  p.CompileCode("a++;");
+  while (!p.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE_FALSE(exitcode);
+  p.CopyAndLoadNewPlugin();
+
+  p.CompileCode("int b = undeclared;");
+  while (!p.TryGetExitStatusFromCompile(exitcode))
+    ;
+  REQUIRE(exitcode);
+}
+#endif
+
 TEST_CASE("destructor order") {
   int exitcode = 0;
 